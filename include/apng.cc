@@ -0,0 +1,741 @@
+#include <algorithm>
+#include <atomic>
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#include <zlib.h>
+
+#include "apng.h"
+#include "corners.h"
+#include "png_io.h"
+
+// Largest payload written per IDAT/fdAT chunk.
+#define APNG_MAX_CHUNK_DATA_BYTES (1 << 20)
+
+// fcTL payload is always 26B.
+#define APNG_FCTL_LENGTH_BYTES 26
+
+
+namespace apng {
+  // Big endian helpers.
+  static uint32_t read_u32(const png_byte* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+  }
+
+  static uint16_t read_u16(const png_byte* p) {
+    return (uint16_t(p[0]) << 8) | uint16_t(p[1]);
+  }
+
+  static void write_u32(std::vector<png_byte>& out, uint32_t v) {
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+  }
+
+  static void write_u16(std::vector<png_byte>& out, uint16_t v) {
+    out.push_back(v >> 8);
+    out.push_back(v);
+  }
+
+  static void write_chunk(std::vector<png_byte>& out, const char* type, const png_byte* data, size_t len) {
+    write_u32(out, len);
+
+    size_t crc_start = out.size();
+    out.insert(out.end(), type, type + 4);
+    if (len > 0) out.insert(out.end(), data, data + len);
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, &out[crc_start], out.size() - crc_start);
+    write_u32(out, crc);
+  }
+
+  // Splits a zlib stream across as many IDAT/fdAT chunks as needed.
+  // fdAT chunks are prefixed with their sequence number.
+  static void write_frame_data(std::vector<png_byte>& out, const std::vector<png_byte>& data, bool as_idat, uint32_t* sequence) {
+    std::vector<png_byte> payload;
+    for (size_t offset = 0; offset < data.size(); offset += APNG_MAX_CHUNK_DATA_BYTES) {
+      size_t len = std::min<size_t>(APNG_MAX_CHUNK_DATA_BYTES, data.size() - offset);
+
+      if (as_idat) {
+        write_chunk(out, "IDAT", &data[offset], len);
+      } else {
+        payload.clear();
+        write_u32(payload, (*sequence)++);
+        payload.insert(payload.end(), data.begin() + offset, data.begin() + offset + len);
+        write_chunk(out, "fdAT", payload.data(), payload.size());
+      }
+    }
+  }
+
+  static int read_file(const std::string& filepath, std::vector<png_byte>* buffer) {
+    std::ifstream img_if;
+    img_if.open(filepath, std::ios::binary | std::ios::in);
+
+    // Early return if failed to open.
+    if (!img_if.is_open()) return -1;
+
+    buffer->assign(std::istreambuf_iterator<char>(img_if), std::istreambuf_iterator<char>());
+    return 0;
+  }
+
+  bool is_apng_file(const std::string& filepath) {
+    std::ifstream img_if;
+    img_if.open(filepath, std::ios::binary | std::ios::in);
+
+    // Early return if failed to open.
+    if (!img_if.is_open()) return false;
+
+    png_byte signature[8];
+    img_if.read(reinterpret_cast<char*>(signature), 8);
+    if (!img_if || png_sig_cmp(signature, 0, 8) != 0) return false;
+
+    // Walk the chunks until image data shows up. acTL must come before it.
+    png_byte chunk_hdr[8];
+    while (img_if.read(reinterpret_cast<char*>(chunk_hdr), 8)) {
+      uint32_t length = read_u32(chunk_hdr);
+
+      if (std::memcmp(&chunk_hdr[4], "acTL", 4) == 0) return true;
+      if (std::memcmp(&chunk_hdr[4], "IDAT", 4) == 0) return false;
+      if (std::memcmp(&chunk_hdr[4], "IEND", 4) == 0) return false;
+
+      // Skip data & CRC.
+      img_if.seekg(std::streamoff(length) + 4, img_if.cur);
+    }
+
+    return false;
+  }
+
+  bool is_apng_buffer(const std::vector<png_byte>& buffer) {
+    if (buffer.size() < 8 || png_sig_cmp(buffer.data(), 0, 8) != 0) return false;
+
+    // Walk the chunks until image data shows up. acTL must come before it.
+    for (size_t offset = 8; offset + 8 <= buffer.size(); ) {
+      const png_byte* type = &buffer[offset + 4];
+
+      if (std::memcmp(type, "acTL", 4) == 0) return true;
+      if (std::memcmp(type, "IDAT", 4) == 0) return false;
+      if (std::memcmp(type, "IEND", 4) == 0) return false;
+
+      // Skip length, type, data & CRC.
+      offset += 12 + size_t(read_u32(&buffer[offset]));
+    }
+
+    return false;
+  }
+
+  static int parse_fctl(const png_byte* data, size_t len, const ImageAPNG& img, FrameControl* fctl) {
+    if (len != APNG_FCTL_LENGTH_BYTES) {
+      fmt::println("Invalid fcTL data size of '{}B'. Expected {}B", len, APNG_FCTL_LENGTH_BYTES);
+      return -1;
+    }
+
+    // Skip the 4B sequence number, frames get renumbered on write.
+    fctl->width      = read_u32(data + 4);
+    fctl->height     = read_u32(data + 8);
+    fctl->x_offset   = read_u32(data + 12);
+    fctl->y_offset   = read_u32(data + 16);
+    fctl->delay_num  = read_u16(data + 20);
+    fctl->delay_den  = read_u16(data + 22);
+    fctl->dispose_op = data[24];
+    fctl->blend_op   = data[25];
+
+    if (fctl->width == 0 || fctl->height == 0 ||
+        uint64_t(fctl->x_offset) + fctl->width > img.width ||
+        uint64_t(fctl->y_offset) + fctl->height > img.height) {
+      fmt::println(
+        "Invalid fcTL frame region {}x{}+{}+{} for a {}x{} canvas",
+        fctl->width, fctl->height, fctl->x_offset, fctl->y_offset, img.width, img.height
+      );
+      return -1;
+    }
+
+    if (fctl->dispose_op > APNG_DISPOSE_OP_PREVIOUS || fctl->blend_op > APNG_BLEND_OP_OVER) {
+      fmt::println("Invalid fcTL dispose op '{}' or blend op '{}'", fctl->dispose_op, fctl->blend_op);
+      return -1;
+    }
+
+    return 0;
+  }
+
+  int parse_apng(const std::vector<png_byte>& buffer, ImageAPNG* img) {
+    if (buffer.size() < 8 || png_sig_cmp(buffer.data(), 0, 8) != 0) {
+      fmt::println("Failed to parse header: Not a PNG image");
+      return -1;
+    }
+
+    bool seen_actl = false;
+    bool seen_ihdr = false;
+    bool seen_fdat = false;
+    bool seen_iend = false;
+    bool seen_image_data = false;
+
+    size_t offset = 8;
+    while (offset + 12 <= buffer.size()) {
+      uint32_t length = read_u32(&buffer[offset]);
+      const png_byte* type = &buffer[offset + 4];
+      const png_byte* data = &buffer[offset + 8];
+
+      if (offset + 12 + length > buffer.size()) {
+        fmt::println("Truncated chunk of '{}B' at offset {}", length, offset);
+        return -1;
+      }
+      offset += 12 + length;
+
+      // IHDR must come first.
+      if (!seen_ihdr) {
+        if (std::memcmp(type, "IHDR", 4) != 0 || length != 13) {
+          fmt::println("Expected a 13B IHDR as the first chunk");
+          return -1;
+        }
+
+        img->ihdr.assign(data, data + length);
+        img->width            = read_u32(data);
+        img->height           = read_u32(data + 4);
+        img->bit_depth        = data[8];
+        img->color_type       = data[9];
+        img->interlace_method = data[12];
+        seen_ihdr = true;
+        continue;
+      }
+
+      if (std::memcmp(type, "IEND", 4) == 0) {
+        seen_iend = true;
+        break;
+      }
+
+      else if (std::memcmp(type, "acTL", 4) == 0) {
+        if (length != 8) {
+          fmt::println("Invalid acTL data size of '{}B'. Expected 8B", length);
+          return -1;
+        }
+        img->actl.num_frames = read_u32(data);
+        img->actl.num_plays  = read_u32(data + 4);
+        seen_actl = true;
+      }
+
+      else if (std::memcmp(type, "fcTL", 4) == 0) {
+        Frame& frame = img->frames.emplace_back();
+        if (parse_fctl(data, length, *img, &frame.fctl) != 0) return -1;
+      }
+
+      else if (std::memcmp(type, "IDAT", 4) == 0) {
+        seen_image_data = true;
+
+        // No fcTL before IDAT means the default image isn't part of the animation.
+        if (img->frames.empty()) {
+          img->hidden_default_image.insert(img->hidden_default_image.end(), data, data + length);
+        } else if (img->frames.size() == 1 && !seen_fdat) {
+          img->frames[0].is_default_image = true;
+          img->frames[0].data.insert(img->frames[0].data.end(), data, data + length);
+        } else {
+          fmt::println("Unexpected IDAT chunk after animation frames");
+          return -1;
+        }
+      }
+
+      else if (std::memcmp(type, "fdAT", 4) == 0) {
+        seen_image_data = true;
+        seen_fdat = true;
+
+        if (length < 4 || img->frames.empty() || img->frames.back().is_default_image) {
+          fmt::println("Unexpected fdAT chunk without a preceding fcTL");
+          return -1;
+        }
+
+        // Drop the 4B sequence number.
+        Frame& frame = img->frames.back();
+        frame.data.insert(frame.data.end(), data + 4, data + length);
+      }
+
+      // Keep any other chunk as is, relative to the image data.
+      else {
+        Chunk& chunk = seen_image_data ? img->chunks_after.emplace_back() : img->chunks_before.emplace_back();
+        std::memcpy(chunk.type, type, 4);
+        chunk.type[4] = '\0';
+        chunk.data.assign(data, data + length);
+      }
+    }
+
+    if (!seen_iend) {
+      fmt::println("Failed to parse image: Missing IEND chunk");
+      return -1;
+    }
+
+    if (!seen_actl || img->frames.empty()) {
+      fmt::println("Failed to parse image: Missing acTL or fcTL chunks");
+      return -1;
+    }
+
+    for (const Frame& frame : img->frames) {
+      if (frame.data.empty()) {
+        fmt::println("Failed to parse image: Frame without image data");
+        return -1;
+      }
+
+      // The default image always covers the full canvas.
+      if (frame.is_default_image &&
+          (frame.fctl.x_offset != 0 || frame.fctl.y_offset != 0 ||
+           frame.fctl.width != img->width || frame.fctl.height != img->height)) {
+        fmt::println("Failed to parse image: Default image frame must cover the canvas");
+        return -1;
+      }
+    }
+
+    return 0;
+  }
+
+  // Format frames get decoded into and encoded from.
+  struct PixelFormat {
+    // Frames are either expanded to 8bit RGBA, or kept in the IHDR's format with sub-byte samples unpacked.
+    bool                  expand_rgba = true;
+
+    // Written into masked pixels, a pixel's worth of bytes.
+    std::vector<png_byte> transparent = { 0, 0, 0, 0 };
+  };
+
+  // A frame's pixels, in its PixelFormat.
+  struct FramePixels {
+    std::vector<png_byte>  pixels;
+    std::vector<png_bytep> row_pointers;
+  };
+
+  static Chunk* find_chunk(std::vector<Chunk>& chunks, const char* type) {
+    for (Chunk& chunk : chunks) {
+      if (std::strcmp(chunk.type, type) == 0) return &chunk;
+    }
+    return nullptr;
+  }
+
+  // Adds a chunk before the image data, after PLTE which tRNS must follow.
+  static Chunk& insert_chunk(ImageAPNG* img, const char* type, const std::vector<png_byte>& data) {
+    auto at = std::find_if(img->chunks_before.begin(), img->chunks_before.end(), [](const Chunk& chunk) {
+      return std::strcmp(chunk.type, "PLTE") == 0;
+    });
+    at = at == img->chunks_before.end() ? at : at + 1;
+
+    Chunk& chunk = *img->chunks_before.insert(at, Chunk());
+    std::memcpy(chunk.type, type, 5);
+    chunk.data = data;
+    return chunk;
+  }
+
+  /**
+   * Decodes a frame by wrapping its zlib stream into a standalone PNG.
+   * Expansion uses the same 8bit RGBA transforms as still images.
+   */
+  static int decode_frame(const ImageAPNG& img, const std::vector<png_byte>& data, uint32_t width, uint32_t height,
+                          const PixelFormat& format, FramePixels* out) {
+    std::vector<png_byte> standalone = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+    std::vector<png_byte> ihdr = img.ihdr;
+    ihdr[0] = width >> 24;  ihdr[1] = width >> 16;  ihdr[2] = width >> 8;  ihdr[3] = width;
+    ihdr[4] = height >> 24; ihdr[5] = height >> 16; ihdr[6] = height >> 8; ihdr[7] = height;
+    write_chunk(standalone, "IHDR", ihdr.data(), ihdr.size());
+
+    // Only the palette & transparency are needed to decode.
+    for (const Chunk& chunk : img.chunks_before) {
+      if (std::strcmp(chunk.type, "PLTE") == 0 || std::strcmp(chunk.type, "tRNS") == 0) {
+        write_chunk(standalone, chunk.type, chunk.data.data(), chunk.data.size());
+      }
+    }
+    write_frame_data(standalone, data, true, nullptr);
+    write_chunk(standalone, "IEND", nullptr, 0);
+
+    png_io::BufferReader reader = { &standalone, 0 };
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) return -1;
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+      png_destroy_read_struct(&png_ptr, NULL, NULL);
+      return -1;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      return -1;
+    }
+
+    png_set_read_fn(png_ptr, &reader, png_io::buffer_read_fn);
+    if (format.expand_rgba) {
+      png_io::read_rgba_info(png_ptr, info_ptr);
+    } else {
+      png_read_info(png_ptr, info_ptr);
+      if (img.bit_depth < 8) png_set_packing(png_ptr);
+      png_read_update_info(png_ptr, info_ptr);
+    }
+
+    size_t rowbytes = png_get_rowbytes(png_ptr, info_ptr);
+    if (rowbytes != size_t(width) * format.transparent.size()) {
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      return -1;
+    }
+
+    out->pixels.resize(rowbytes * height);
+    out->row_pointers.resize(height);
+    for (uint32_t y = 0; y < height; y++) {
+      out->row_pointers[y] = &out->pixels[y * rowbytes];
+    }
+
+    png_read_image(png_ptr, out->row_pointers.data());
+    png_read_end(png_ptr, NULL);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return 0;
+  }
+
+  // Encodes a frame's pixels and keeps only the resulting zlib stream.
+  static int encode_frame(const ImageAPNG& img, FramePixels& frame, uint32_t width, uint32_t height,
+                          const PixelFormat& format, std::vector<png_byte>* data) {
+    std::vector<png_byte> encoded;
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) return -1;
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+      png_destroy_write_struct(&png_ptr, NULL);
+      return -1;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      return -1;
+    }
+
+    png_set_write_fn(png_ptr, &encoded, png_io::buffer_write_fn, png_io::buffer_flush_fn);
+    png_set_IHDR(
+      png_ptr,
+      info_ptr,
+      width, height,
+      format.expand_rgba ? 8 : img.bit_depth,
+      format.expand_rgba ? PNG_COLOR_TYPE_RGBA : img.color_type,
+      PNG_INTERLACE_NONE,
+      PNG_COMPRESSION_TYPE_DEFAULT,
+      PNG_FILTER_TYPE_DEFAULT
+    );
+
+    // Palette frames can't be written without their PLTE, though only the IDAT is kept.
+    if (!format.expand_rgba && img.color_type == PNG_COLOR_TYPE_PALETTE) {
+      for (const Chunk& chunk : img.chunks_before) {
+        if (std::strcmp(chunk.type, "PLTE") == 0) {
+          png_set_PLTE(png_ptr, info_ptr, reinterpret_cast<png_const_colorp>(chunk.data.data()), chunk.data.size() / 3);
+        }
+      }
+    }
+
+    png_set_rows(png_ptr, info_ptr, frame.row_pointers.data());
+    png_write_png(png_ptr, info_ptr, !format.expand_rgba && img.bit_depth < 8 ? PNG_TRANSFORM_PACKING : PNG_TRANSFORM_IDENTITY, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    // Pull the IDAT payloads back out.
+    data->clear();
+    for (size_t offset = 8; offset + 12 <= encoded.size(); ) {
+      uint32_t length = read_u32(&encoded[offset]);
+      if (std::memcmp(&encoded[offset + 4], "IDAT", 4) == 0) {
+        data->insert(data->end(), &encoded[offset + 8], &encoded[offset + 8] + length);
+      }
+      offset += 12 + length;
+    }
+
+    return 0;
+  }
+
+  /**
+   * Picks a color key for gray or RGB frames, reusing the tRNS one or else finding a value
+   * no frame uses, which means decoding every frame.
+   *
+   * @returns Status code, where non-zero means every value is in use.
+   */
+  static int find_color_key(ImageAPNG* img, PixelFormat* format) {
+    bool is_rgb = img->color_type == PNG_COLOR_TYPE_RGB;
+    if (Chunk* trns = find_chunk(img->chunks_before, "tRNS")) {
+      if (trns->data.size() != (is_rgb ? 6 : 2)) return -1;
+      for (size_t c = 0; c < format->transparent.size(); c++) {
+        format->transparent[c] = trns->data[c * 2 + 1];
+      }
+      return 0;
+    }
+
+    // A bit per possible sample value or RGB color.
+    std::vector<bool> used(is_rgb ? size_t(1) << 24 : size_t(1) << img->bit_depth);
+    FramePixels pixels;
+    auto mark_used = [&](const std::vector<png_byte>& data, uint32_t width, uint32_t height) {
+      if (decode_frame(*img, data, width, height, *format, &pixels) != 0) return false;
+      for (size_t i = 0; i < pixels.pixels.size(); i += format->transparent.size()) {
+        const png_byte* px = &pixels.pixels[i];
+        used[is_rgb ? (size_t(px[0]) << 16) | (size_t(px[1]) << 8) | px[2] : px[0]] = true;
+      }
+      return true;
+    };
+
+    if (!img->hidden_default_image.empty() && !mark_used(img->hidden_default_image, img->width, img->height)) return -1;
+    for (const Frame& frame : img->frames) {
+      if (!mark_used(frame.data, frame.fctl.width, frame.fctl.height)) return -1;
+    }
+
+    auto unused = std::find(used.begin(), used.end(), false);
+    if (unused == used.end()) return -1;
+
+    size_t key = unused - used.begin();
+    std::vector<png_byte> trns;
+    if (is_rgb) {
+      format->transparent = { png_byte(key >> 16), png_byte(key >> 8), png_byte(key) };
+      trns = { 0, png_byte(key >> 16), 0, png_byte(key >> 8), 0, png_byte(key) };
+    } else {
+      format->transparent = { png_byte(key) };
+      trns = { 0, png_byte(key) };
+    }
+    insert_chunk(img, "tRNS", trns);
+    return 0;
+  }
+
+  /**
+   * Picks how masked pixels get written without changing the image's format, so that
+   * untouched frames keep their bytes: alpha for 8bit RGBA & gray alpha, an alpha 0
+   * palette entry, or a tRNS color key for 8bit RGB & gray.
+   *
+   * @returns Status code, where non-zero means every frame has to be converted to 8bit RGBA.
+   */
+  static int native_format(ImageAPNG* img, PixelFormat* format) {
+    if (img->interlace_method != PNG_INTERLACE_NONE) return -1;
+    format->expand_rgba = false;
+
+    switch (img->color_type) {
+      case PNG_COLOR_TYPE_RGB_ALPHA:
+      case PNG_COLOR_TYPE_GRAY_ALPHA:
+        if (img->bit_depth != 8) return -1;
+        format->transparent.assign(img->color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4 : 2, 0);
+        return 0;
+
+      case PNG_COLOR_TYPE_RGB:
+      case PNG_COLOR_TYPE_GRAY:
+        if (img->bit_depth > 8) return -1;
+        format->transparent.assign(img->color_type == PNG_COLOR_TYPE_RGB ? 3 : 1, 0);
+        return find_color_key(img, format);
+
+      case PNG_COLOR_TYPE_PALETTE: {
+        Chunk* plte = find_chunk(img->chunks_before, "PLTE");
+        if (!plte) return -1;
+        Chunk* trns = find_chunk(img->chunks_before, "tRNS");
+
+        // Reuse a fully transparent entry.
+        if (trns) {
+          auto entry = std::find(trns->data.begin(), trns->data.end(), 0);
+          if (entry != trns->data.end()) {
+            format->transparent = { png_byte(entry - trns->data.begin()) };
+            return 0;
+          }
+        }
+
+        // Otherwise add one, when the bit depth has room for it. Entries past tRNS stay opaque.
+        size_t entries = plte->data.size() / 3;
+        if (entries >= (size_t(1) << img->bit_depth)) return -1;
+
+        plte->data.insert(plte->data.end(), { 0, 0, 0 });
+        if (!trns) trns = &insert_chunk(img, "tRNS", {});
+        trns->data.resize(entries + 1, 255);
+        trns->data[entries] = 0;
+
+        // The histogram has to match the palette's length.
+        std::erase_if(img->chunks_before, [](const Chunk& chunk) { return std::strcmp(chunk.type, "hIST") == 0; });
+        std::erase_if(img->chunks_after, [](const Chunk& chunk) { return std::strcmp(chunk.type, "hIST") == 0; });
+        format->transparent = { png_byte(entries) };
+        return 0;
+      }
+    }
+
+    return -1;
+  }
+
+  // A region of the canvas that needs to be re-encoded.
+  struct FrameTask {
+    std::vector<png_byte>* data;
+    corners::Rect          rect;
+    bool*                  modified;
+  };
+
+  int apply_radius(size_t radius_px, ImageAPNG* img, size_t workers, Stats* stats) {
+    // Frames share the IHDR's format, which is kept whenever masked pixels can be expressed in it.
+    // Otherwise every frame gets converted to 8bit RGBA, and the IHDR along with it.
+    PixelFormat format;
+    bool convert_all = native_format(img, &format) != 0;
+    if (convert_all) format = PixelFormat();
+
+    ssize_t canvas_width  = img->width;
+    ssize_t canvas_height = img->height;
+
+    // Only frames overlapping a corner get touched. Since every frame covering a corner pixel
+    // leaves it transparent, the corners stay transparent regardless of dispose/blend ops:
+    // SOURCE writes the transparent pixel, OVER keeps the already transparent canvas.
+    std::vector<FrameTask> tasks;
+    bool hidden_modified = false;
+    if (!img->hidden_default_image.empty()) {
+      tasks.push_back({ &img->hidden_default_image, { 0, 0, canvas_width, canvas_height }, &hidden_modified });
+    }
+
+    for (Frame& frame : img->frames) {
+      corners::Rect rect = {
+        frame.fctl.x_offset,
+        frame.fctl.y_offset,
+        frame.fctl.width,
+        frame.fctl.height,
+      };
+
+      if (convert_all || corners::overlaps_corner(rect, canvas_width, canvas_height, radius_px)) {
+        tasks.push_back({ &frame.data, rect, &frame.modified });
+      }
+    }
+
+    // Decode, mask & encode frames in parallel.
+    if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, tasks.size());
+    std::atomic<size_t> next_task = 0;
+    std::atomic<size_t> masked_pixels = 0;
+    std::atomic<bool>   failed = false;
+
+    auto worker = [&]() {
+      FramePixels pixels;
+      std::vector<png_byte> encoded;
+
+      for (size_t i = next_task++; i < tasks.size() && !failed; i = next_task++) {
+        FrameTask& task = tasks[i];
+        uint32_t width  = task.rect.width;
+        uint32_t height = task.rect.height;
+
+        if (decode_frame(*img, *task.data, width, height, format, &pixels) != 0) {
+          fmt::println("Failed to decode frame at {}x{}+{}+{}", width, height, task.rect.x, task.rect.y);
+          failed = true;
+          break;
+        }
+
+        masked_pixels += corners::apply_clipped(task.rect, canvas_width, canvas_height, radius_px, pixels.row_pointers.data(),
+                                                format.transparent.data(), format.transparent.size());
+
+        if (encode_frame(*img, pixels, width, height, format, &encoded) != 0) {
+          fmt::println("Failed to encode frame at {}x{}+{}+{}", width, height, task.rect.x, task.rect.y);
+          failed = true;
+          break;
+        }
+
+        task.data->swap(encoded);
+        *task.modified = true;
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++) {
+      threads.emplace_back(worker);
+    }
+    if (workers > 0) worker();
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    if (failed) return -1;
+
+    // Frames are all RGBA now, so the IHDR and color dependent chunks follow.
+    if (convert_all) {
+      img->bit_depth        = img->ihdr[8]  = 8;
+      img->color_type       = img->ihdr[9]  = PNG_COLOR_TYPE_RGBA;
+      img->interlace_method = img->ihdr[12] = PNG_INTERLACE_NONE;
+
+      auto is_color_dependent = [](const Chunk& chunk) {
+        return std::strcmp(chunk.type, "PLTE") == 0 ||
+               std::strcmp(chunk.type, "tRNS") == 0 ||
+               std::strcmp(chunk.type, "bKGD") == 0 ||
+               std::strcmp(chunk.type, "sBIT") == 0 ||
+               std::strcmp(chunk.type, "hIST") == 0;
+      };
+      std::erase_if(img->chunks_before, is_color_dependent);
+      std::erase_if(img->chunks_after, is_color_dependent);
+    }
+
+    stats->frames          = img->frames.size();
+    stats->modified_frames = std::count_if(img->frames.begin(), img->frames.end(), [](const Frame& f) { return f.modified; });
+    stats->masked_pixels   = masked_pixels;
+    stats->workers         = workers;
+    return 0;
+  }
+
+  int write_apng(const ImageAPNG& img, std::vector<png_byte>* out) {
+    out->assign({ 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' });
+    write_chunk(*out, "IHDR", img.ihdr.data(), img.ihdr.size());
+
+    for (const Chunk& chunk : img.chunks_before) {
+      write_chunk(*out, chunk.type, chunk.data.data(), chunk.data.size());
+    }
+
+    std::vector<png_byte> payload;
+    write_u32(payload, img.frames.size());
+    write_u32(payload, img.actl.num_plays);
+    write_chunk(*out, "acTL", payload.data(), payload.size());
+
+    if (!img.hidden_default_image.empty()) {
+      write_frame_data(*out, img.hidden_default_image, true, nullptr);
+    }
+
+    // fcTL & fdAT share one sequence.
+    uint32_t sequence = 0;
+    for (const Frame& frame : img.frames) {
+      payload.clear();
+      write_u32(payload, sequence++);
+      write_u32(payload, frame.fctl.width);
+      write_u32(payload, frame.fctl.height);
+      write_u32(payload, frame.fctl.x_offset);
+      write_u32(payload, frame.fctl.y_offset);
+      write_u16(payload, frame.fctl.delay_num);
+      write_u16(payload, frame.fctl.delay_den);
+      payload.push_back(frame.fctl.dispose_op);
+      payload.push_back(frame.fctl.blend_op);
+      write_chunk(*out, "fcTL", payload.data(), payload.size());
+
+      write_frame_data(*out, frame.data, frame.is_default_image, &sequence);
+    }
+
+    for (const Chunk& chunk : img.chunks_after) {
+      write_chunk(*out, chunk.type, chunk.data.data(), chunk.data.size());
+    }
+    write_chunk(*out, "IEND", nullptr, 0);
+    return 0;
+  }
+
+  int process_buffer(const std::vector<png_byte>& in, std::vector<png_byte>* out, size_t radius_px, size_t workers, Stats* stats) {
+    ImageAPNG img;
+    if (parse_apng(in, &img) != 0) {
+      fmt::println("Failed to parse animated image");
+      return -1;
+    }
+
+    if (apply_radius(radius_px, &img, workers, stats) != 0) {
+      fmt::println("Failed to apply radius around animated image");
+      return -1;
+    }
+
+    if (write_apng(img, out) != 0) {
+      fmt::println("Failed to serialize animated image");
+      return -1;
+    }
+    return 0;
+  }
+
+  int process_file(const std::string& in_filepath, const std::string& out_filepath, size_t radius_px, Stats* stats) {
+    std::vector<png_byte> in;
+    if (read_file(in_filepath, &in) != 0) {
+      fmt::println("Failed to open image '{}'", in_filepath);
+      return -1;
+    }
+
+    std::vector<png_byte> out;
+    if (process_buffer(in, &out, radius_px, 0, stats) != 0) {
+      return -1;
+    }
+
+    return png_io::write_file(out_filepath, out) == 0 ? 0 : -1;
+  }
+};
@@ -0,0 +1,166 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <libpng16/png.h>
+#include <string>
+#include <vector>
+
+// Animated PNG support. libpng only decodes the default image, so frames are
+// split out at the chunk level, decoded/re-encoded as standalone PNGs and stitched back.
+// Docs:
+//  - https://wiki.mozilla.org/APNG_Specification
+namespace apng {
+  // fcTL dispose_op values.
+  #define APNG_DISPOSE_OP_NONE       0
+  #define APNG_DISPOSE_OP_BACKGROUND 1
+  #define APNG_DISPOSE_OP_PREVIOUS   2
+
+  // fcTL blend_op values.
+  #define APNG_BLEND_OP_SOURCE 0
+  #define APNG_BLEND_OP_OVER   1
+
+  // Generic chunk kept verbatim.
+  struct Chunk {
+    char                  type[5]; // Human readable (extra byte for \0)
+    std::vector<png_byte> data;
+  };
+
+  // acTL, animation control.
+  struct AnimationControl {
+    uint32_t num_frames;
+    uint32_t num_plays;
+  };
+
+  // fcTL, frame control. Sequence numbers are reassigned when writing.
+  struct FrameControl {
+    uint32_t width;
+    uint32_t height;
+    uint32_t x_offset;
+    uint32_t y_offset;
+    uint16_t delay_num;
+    uint16_t delay_den;
+    png_byte dispose_op;
+    png_byte blend_op;
+  };
+
+  struct Frame {
+    FrameControl          fctl;
+
+    // Whether the frame's data lives in IDAT, making it the default image as well.
+    bool                  is_default_image = false;
+
+    // Concatenated zlib stream of the frame's IDAT/fdAT chunks.
+    std::vector<png_byte> data;
+
+    // Whether the data was re-encoded, otherwise the original bytes pass through.
+    bool                  modified = false;
+  };
+
+  // Parsed APNG image.
+  struct ImageAPNG {
+    // Raw IHDR data, along with the fields needed to process frames.
+    std::vector<png_byte> ihdr;
+    uint32_t              width;
+    uint32_t              height;
+    png_byte              bit_depth;
+    png_byte              color_type;
+    png_byte              interlace_method;
+
+    AnimationControl      actl;
+
+    // Ancillary chunks before and after the image data, excluding acTL.
+    std::vector<Chunk>    chunks_before;
+    std::vector<Chunk>    chunks_after;
+
+    // IDAT data of a default image which is not part of the animation, if any.
+    std::vector<png_byte> hidden_default_image;
+
+    std::vector<Frame>    frames;
+  };
+
+  // Results of processing an APNG image.
+  struct Stats {
+    size_t frames          = 0;
+    size_t modified_frames = 0;
+    size_t masked_pixels   = 0;
+    size_t workers         = 0;
+  };
+
+  /**
+   * Checks whether the given PNG file carries an acTL chunk before its image data.
+   *
+   * @param filepath Filepath to the image
+   *
+   * @returns Boolean indicating whether the image is animated
+   */
+  bool is_apng_file(const std::string& filepath);
+
+  /**
+   * Checks whether the given PNG contents carry an acTL chunk before their image data.
+   *
+   * @param buffer Full file contents
+   *
+   * @returns Boolean indicating whether the image is animated
+   */
+  bool is_apng_buffer(const std::vector<png_byte>& buffer);
+
+  /**
+   * Parses an APNG file into its frames.
+   *
+   * @param buffer Full file contents.
+   * @param img Image pointer for which to populate.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int parse_apng(const std::vector<png_byte>& buffer, ImageAPNG* img);
+
+  /**
+   * Applies the canvas-level corner radius to every frame that overlaps a corner.
+   * Frames are decoded and re-encoded in parallel, untouched frames keep their bytes. The image's
+   * format is kept whenever the masked pixels fit it, adding a tRNS palette entry or color key if needed.
+   * Otherwise, e.g. for 16bit, interlaced or fully used palettes, every frame is converted to 8bit RGBA.
+   *
+   * @param radius_px Radius to apply to the canvas
+   * @param img Parsed image to update in place
+   * @param workers Frame worker threads, 0 uses all cores
+   * @param stats Stats pointer for which to populate
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int apply_radius(size_t radius_px, ImageAPNG* img, size_t workers, Stats* stats);
+
+  /**
+   * Serializes the APNG image back into a PNG byte stream.
+   *
+   * @param img Image to serialize
+   * @param out Buffer for which to populate.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int write_apng(const ImageAPNG& img, std::vector<png_byte>* out);
+
+  /**
+   * Masks an APNG held in memory.
+   *
+   * @param in Full contents of the animated PNG
+   * @param out Buffer for which to populate with the resulting image.
+   * @param radius_px Radius to apply to the canvas
+   * @param workers Frame worker threads, 0 uses all cores
+   * @param stats Stats pointer for which to populate
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int process_buffer(const std::vector<png_byte>& in, std::vector<png_byte>* out, size_t radius_px, size_t workers, Stats* stats);
+
+  /**
+   * Reads, masks and writes an APNG file.
+   *
+   * @param in_filepath Filepath to the animated PNG
+   * @param out_filepath Resulting image path. '-' writes to stdout.
+   * @param radius_px Radius to apply to the canvas
+   * @param stats Stats pointer for which to populate
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int process_file(const std::string& in_filepath, const std::string& out_filepath, size_t radius_px, Stats* stats);
+};
@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <libpng16/png.h>
+#include <stdexcept>
+#include <sys/resource.h>
+
+#include "budget.h"
+
+
+namespace budget {
+  int parse_bytes(const std::string& value, size_t* bytes) {
+    size_t consumed = 0;
+    unsigned long long number;
+    try {
+      number = std::stoull(value, &consumed);
+    } catch( std::exception& ) {
+      return -1;
+    }
+
+    std::string suffix = value.substr(consumed);
+    if (suffix.empty() || suffix == "B") {
+      *bytes = number;
+    } else if (suffix == "K" || suffix == "KB") {
+      *bytes = number << 10;
+    } else if (suffix == "M" || suffix == "MB") {
+      *bytes = number << 20;
+    } else if (suffix == "G" || suffix == "GB") {
+      *bytes = number << 30;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+
+  size_t decoded_bytes(uint32_t width, uint32_t height) {
+    return size_t(width) * height * 4 + size_t(height) * sizeof(png_bytep);
+  }
+
+  size_t streamed_bytes(uint32_t width) {
+    return size_t(width) * 4;
+  }
+
+  bool try_acquire(Budget* budget, size_t bytes) {
+    std::lock_guard<std::mutex> lock(budget->mutex);
+    if (budget->limit_bytes != 0 && budget->in_use_bytes + bytes > budget->limit_bytes) return false;
+
+    budget->in_use_bytes += bytes;
+    budget->peak_bytes = std::max(budget->peak_bytes, budget->in_use_bytes);
+    return true;
+  }
+
+  void release(Budget* budget, size_t bytes) {
+    std::lock_guard<std::mutex> lock(budget->mutex);
+    budget->in_use_bytes -= bytes;
+  }
+
+  size_t peak_rss_bytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+
+    // Linux reports kilobytes.
+    return size_t(usage.ru_maxrss) * 1024;
+  }
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// Memory admission control for parallel jobs. Each job reserves its estimated footprint
+// before its input is even read, and is held while the reservations in flight wouldn't fit the budget.
+namespace budget {
+  struct Budget {
+    // Ceiling for the reservations in flight, 0 means unlimited.
+    size_t                  limit_bytes = 0;
+
+    std::mutex              mutex;
+    size_t                  in_use_bytes = 0;
+
+    size_t                  peak_bytes = 0;
+    size_t                  waits = 0;
+  };
+
+  /**
+   * Parses a byte size, with an optional K, M or G suffix (powers of 1024).
+   *
+   * @param value Size such as '512M' or '16G'
+   * @param bytes Size pointer for which to populate.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int parse_bytes(const std::string& value, size_t* bytes);
+
+  /**
+   * Estimated memory held while a fully decoded image is processed, being its
+   * 8bit RGBA rows and their pointers.
+   *
+   * @param width Image width in pixels
+   * @param height Image height in pixels
+   *
+   * @returns Footprint in bytes
+   */
+  size_t decoded_bytes(uint32_t width, uint32_t height);
+
+  /**
+   * Estimated memory held while an image is streamed through a single 8bit RGBA row.
+   *
+   * @param width Image width in pixels
+   *
+   * @returns Footprint in bytes
+   */
+  size_t streamed_bytes(uint32_t width);
+
+  /**
+   * Takes the reservation if it fits within the budget, without waiting. Callers
+   * admit jobs in order, so a large one isn't starved by smaller ones after it.
+   *
+   * @param budget Shared budget
+   * @param bytes Bytes to reserve
+   *
+   * @returns Whether the reservation was taken.
+   */
+  bool try_acquire(Budget* budget, size_t bytes);
+
+  /**
+   * Returns a reservation taken through try_acquire.
+   *
+   * @param budget Shared budget
+   * @param bytes Bytes to return
+   */
+  void release(Budget* budget, size_t bytes);
+
+  /**
+   * Returns the process' peak resident set size.
+   */
+  size_t peak_rss_bytes();
+};
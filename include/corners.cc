@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "corners.h"
+
+
+namespace corners {
+  // Each corner is a square region with the circle's midpoint it gets masked against.
+  // Matches the regions walked by apply_radius.
+  struct CornerRegion {
+    Rect region;
+    Vector2D<ssize_t> midpoint;
+  };
+
+  static void corner_regions(ssize_t width, ssize_t height, ssize_t radius, CornerRegion out[4]) {
+    ssize_t x0 = width - 1 - radius;
+    ssize_t y0 = height - 1 - radius;
+
+    // Top left.
+    out[0] = { { 0, 0, radius, radius }, { radius, radius } };
+
+    // Top right.
+    out[1] = { { x0, 0, width - x0, radius }, { x0, radius } };
+
+    // Bottom right.
+    out[2] = { { x0, y0, width - x0, height - y0 }, { x0, y0 } };
+
+    // Bottom left.
+    out[3] = { { 0, y0, radius, height - y0 }, { radius, y0 } };
+  }
+
+  // Intersection of two rectangles. Empty intersections have a non-positive size.
+  static Rect intersect(const Rect& a, const Rect& b) {
+    ssize_t x  = std::max(a.x, b.x);
+    ssize_t y  = std::max(a.y, b.y);
+    ssize_t x1 = std::min(a.x + a.width, b.x + b.width);
+    ssize_t y1 = std::min(a.y + a.height, b.y + b.height);
+    return { x, y, x1 - x, y1 - y };
+  }
+
+  bool is_inside_circle(Vector2D<ssize_t> point, Vector2D<ssize_t> circle_midpoint, ssize_t radius) {
+    ssize_t a = std::labs( point.x - circle_midpoint.x );
+    ssize_t b = std::labs( point.y - circle_midpoint.y );
+    ssize_t c = std::sqrt( (a*a) + (b*b) );
+    return c < radius;
+  }
+
+  bool overlaps_corner(const Rect& rect, ssize_t canvas_width, ssize_t canvas_height, ssize_t radius) {
+    CornerRegion regions[4];
+    corner_regions(canvas_width, canvas_height, radius, regions);
+
+    for (const CornerRegion& corner : regions) {
+      Rect overlap = intersect(rect, corner.region);
+      if (overlap.width > 0 && overlap.height > 0) return true;
+    }
+    return false;
+  }
+
+  size_t apply_clipped(const Rect& rect, ssize_t canvas_width, ssize_t canvas_height, ssize_t radius, png_bytepp row_pointers,
+                       const png_byte* transparent, size_t pixel_bytes) {
+    static const png_byte transparent_rgba[4] = { 0, 0, 0, 0 };
+    if (!transparent) {
+      transparent = transparent_rgba;
+      pixel_bytes = 4;
+    }
+
+    CornerRegion regions[4];
+    corner_regions(canvas_width, canvas_height, radius, regions);
+
+    size_t masked = 0;
+    for (const CornerRegion& corner : regions) {
+      Rect overlap = intersect(rect, corner.region);
+
+      for (ssize_t y = overlap.y; y < overlap.y + overlap.height; y++) {
+        png_bytep row = row_pointers[y - rect.y];
+        for (ssize_t x = overlap.x; x < overlap.x + overlap.width; x++) {
+          // Only update the pixel within the circle radius.
+          if (!is_inside_circle({ x, y }, corner.midpoint, radius)) {
+            png_bytep px = &(row[(x - rect.x) * pixel_bytes]);
+
+            // Make transparent!
+            std::memcpy(px, transparent, pixel_bytes);
+            masked++;
+          }
+        }
+      }
+    }
+
+    return masked;
+  }
+};
@@ -0,0 +1,61 @@
+#pragma once
+#include <cstddef>
+#include <libpng16/png.h>
+#include <sys/types.h>
+
+template<typename T>
+struct Vector2D {
+  T x;
+  T y;
+};
+
+// Corner mask geometry shared between the still image and animated frame paths.
+namespace corners {
+  // Rectangle in canvas coordinates.
+  struct Rect {
+    ssize_t x;
+    ssize_t y;
+    ssize_t width;
+    ssize_t height;
+  };
+
+  /**
+  * Checks whether the given point is inside the circle.
+  *
+  * @param point The current point being checked
+  * @param circle_midpoint Point in the center of the circle
+  * @param radius Circle's radius
+  *
+  * @returns Boolean indicating whether the point is in the circle
+  */
+  bool is_inside_circle(Vector2D<ssize_t> point, Vector2D<ssize_t> circle_midpoint, ssize_t radius);
+
+  /**
+  * Checks whether the given rectangle touches any of the canvas' corner regions.
+  *
+  * @param rect Rectangle in canvas coordinates
+  * @param canvas_width Width of the full canvas
+  * @param canvas_height Height of the full canvas
+  * @param radius Corner radius
+  *
+  * @returns Boolean indicating whether any pixel of rect may be masked
+  */
+  bool overlaps_corner(const Rect& rect, ssize_t canvas_width, ssize_t canvas_height, ssize_t radius);
+
+  /**
+  * Applies the canvas-level corner mask to a sub-rectangle of the canvas.
+  * The rows only hold the rectangle's pixels, in 8bit RGBA unless a pixel format is given.
+  *
+  * @param rect Rectangle the rows cover, in canvas coordinates
+  * @param canvas_width Width of the full canvas
+  * @param canvas_height Height of the full canvas
+  * @param radius Corner radius
+  * @param row_pointers The rectangle's pixels
+  * @param transparent Pixel written into masked pixels, NULL for transparent 8bit RGBA
+  * @param pixel_bytes Bytes per pixel, matching transparent
+  *
+  * @returns Number of pixels made transparent
+  */
+  size_t apply_clipped(const Rect& rect, ssize_t canvas_width, ssize_t canvas_height, ssize_t radius, png_bytepp row_pointers,
+                       const png_byte* transparent = NULL, size_t pixel_bytes = 4);
+};
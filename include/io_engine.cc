@@ -0,0 +1,885 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <queue>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+
+#include "io_engine.h"
+
+// Reads past a full registered slot grow the buffer by this much at a time.
+#define IO_SPILL_READ_BYTES (1024 * 1024)
+
+
+namespace io {
+  int parse_engine(const std::string& name, EngineType* engine) {
+    if (name == "blocking") *engine = EngineType::Blocking;
+    else if (name == "uring") *engine = EngineType::Uring;
+    else return -1;
+    return 0;
+  }
+
+  const char* engine_name(EngineType engine) {
+    return engine == EngineType::Uring ? "uring" : "blocking";
+  }
+
+  static size_t resolve_workers(size_t workers) {
+    return workers == 0 ? std::max(1u, std::thread::hardware_concurrency()) : workers;
+  }
+
+  // Counters shared between threads, copied into Stats once done.
+  struct Counters {
+    std::atomic<size_t> syscalls = 0;
+    std::atomic<size_t> ops = 0;
+    std::atomic<size_t> bytes_read = 0;
+    std::atomic<size_t> bytes_written = 0;
+
+    std::atomic<size_t> inflight = 0;
+    std::atomic<size_t> max_queue_depth = 0;
+    std::atomic<size_t> depth_samples = 0;
+    std::atomic<size_t> depth_sum = 0;
+
+    void sample_depth(size_t depth) {
+      depth_samples++;
+      depth_sum += depth;
+
+      size_t max = max_queue_depth;
+      while (depth > max && !max_queue_depth.compare_exchange_weak(max, depth)) {}
+    }
+
+    void copy_to(Stats* stats) {
+      stats->syscalls        = syscalls;
+      stats->ops             = ops;
+      stats->bytes_read      = bytes_read;
+      stats->bytes_written   = bytes_written;
+      stats->max_queue_depth = max_queue_depth;
+      stats->avg_queue_depth = depth_samples ? double(depth_sum) / depth_samples : 0;
+    }
+  };
+
+
+  // Blocking engine.
+
+  static int read_file_blocking(const std::string& filepath, std::vector<png_byte>* out, Counters& counters) {
+    int fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    counters.syscalls++;
+    if (fd < 0) return -errno;
+
+    struct stat st;
+    counters.syscalls++;
+    if (fstat(fd, &st) != 0) {
+      int err = -errno;
+      close(fd);
+      return err;
+    }
+
+    out->resize(st.st_size);
+    size_t offset = 0;
+    while (offset < out->size()) {
+      ssize_t n = read(fd, out->data() + offset, out->size() - offset);
+      counters.syscalls++;
+      if (n <= 0) break;
+      offset += n;
+    }
+    out->resize(offset);
+    counters.bytes_read += offset;
+
+    close(fd);
+    counters.syscalls++;
+    return 0;
+  }
+
+  static int write_file_blocking(const std::string& filepath, const std::vector<png_byte>& data, Counters& counters) {
+    int fd = open(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    counters.syscalls++;
+    if (fd < 0) return -errno;
+
+    size_t offset = 0;
+    while (offset < data.size()) {
+      ssize_t n = write(fd, data.data() + offset, data.size() - offset);
+      counters.syscalls++;
+      if (n < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+      }
+      offset += n;
+    }
+    counters.bytes_written += offset;
+
+    counters.syscalls++;
+    return close(fd) == 0 ? 0 : -errno;
+  }
+
+  static int run_blocking(const Options& opts, Counters& counters, const std::vector<Job>& jobs, const ProcessFn& process, const DoneFn& done, const Hooks& hooks) {
+    size_t syscalls_before = counters.syscalls;
+    std::mutex done_mutex;
+    std::atomic<size_t> next_job = 0;
+    size_t workers = std::min(resolve_workers(opts.workers), std::max<size_t>(1, jobs.size()));
+
+    // Admission happens in job order, so a large job isn't starved by smaller ones after it.
+    std::mutex admit_mutex;
+    std::condition_variable admit_cv;
+    size_t admit_turn = 0;
+    bool stopped = false;
+
+    auto cancel = [&]() {
+      if (!hooks.cancelled || !hooks.cancelled()) return false;
+      {
+        std::lock_guard<std::mutex> lock(admit_mutex);
+        stopped = true;
+      }
+      admit_cv.notify_all();
+      return true;
+    };
+
+    auto admit = [&](size_t i) {
+      std::unique_lock<std::mutex> lock(admit_mutex);
+      admit_cv.wait(lock, [&]() { return admit_turn == i || stopped; });
+      if (stopped) return Admission::Wait;
+
+      Admission admission;
+      while ((admission = hooks.admit(i)) == Admission::Wait) {
+        admit_cv.wait(lock);
+        if (stopped) return Admission::Wait;
+      }
+      admit_turn++;
+      admit_cv.notify_all();
+      return admission;
+    };
+
+    auto release = [&](size_t i) {
+      if (!hooks.release) return;
+      {
+        std::lock_guard<std::mutex> lock(admit_mutex);
+        hooks.release(i);
+      }
+      admit_cv.notify_all();
+    };
+
+    auto worker = [&]() {
+      std::vector<png_byte> in;
+      std::vector<png_byte> out;
+
+      for (size_t i = next_job++; i < jobs.size(); i = next_job++) {
+        const Job& job = jobs[i];
+        if (cancel()) break;
+
+        if (hooks.admit) {
+          Admission admission = admit(i);
+          if (admission == Admission::Wait) break;
+          if (admission == Admission::Reject) {
+            std::lock_guard<std::mutex> lock(done_mutex);
+            done(i, -ENOMEM);
+            continue;
+          }
+        }
+
+        counters.sample_depth(++counters.inflight);
+        int status = read_file_blocking(job.in_filepath, &in, counters);
+        counters.inflight--;
+
+        if (status != 0) {
+          fmt::println("Failed to open image '{}': {}", job.in_filepath, std::strerror(-status));
+        } else if ((status = process(i, job, in, &out)) == 0) {
+          if (cancel()) {
+            release(i);
+            break;
+          }
+
+          counters.sample_depth(++counters.inflight);
+          status = write_file_blocking(job.out_filepath, out, counters);
+          counters.inflight--;
+
+          if (status != 0) {
+            fmt::println("Failed write image to '{}': {}", job.out_filepath, std::strerror(-status));
+          }
+        }
+
+        // Admitted jobs only hold what they reserved, rather than the largest buffers seen so far.
+        if (hooks.admit) {
+          std::vector<png_byte>().swap(in);
+          std::vector<png_byte>().swap(out);
+        }
+        release(i);
+
+        std::lock_guard<std::mutex> lock(done_mutex);
+        done(i, status);
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    // Every blocking syscall is a single I/O operation.
+    counters.ops += counters.syscalls - syscalls_before;
+    return 0;
+  }
+
+
+  // io_uring engine, talking to the kernel directly through its syscalls & shared rings.
+
+  struct Ring {
+    int fd = -1;
+
+    unsigned*     sq_head;
+    unsigned*     sq_tail;
+    unsigned*     sq_mask;
+    unsigned*     sq_array;
+    unsigned      sq_entries;
+    io_uring_sqe* sqes;
+    unsigned      sq_local_tail;
+    unsigned      to_submit = 0;
+
+    unsigned*     cq_head;
+    unsigned*     cq_tail;
+    unsigned*     cq_mask;
+    io_uring_cqe* cqes;
+
+    void*  sq_ring = MAP_FAILED;
+    size_t sq_ring_bytes = 0;
+    void*  cq_ring = MAP_FAILED;
+    size_t cq_ring_bytes = 0;
+    size_t sqes_bytes = 0;
+  };
+
+  static void ring_teardown(Ring* ring) {
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_bytes);
+    if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_bytes);
+    if (ring->sqes_bytes) munmap(ring->sqes, ring->sqes_bytes);
+    if (ring->fd >= 0) close(ring->fd);
+    ring->fd = -1;
+  }
+
+  static int ring_setup(Ring* ring, unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -errno;
+
+    ring->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // Newer kernels map both rings at once.
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+      ring->sq_ring_bytes = ring->cq_ring_bytes = std::max(ring->sq_ring_bytes, ring->cq_ring_bytes);
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+      int err = -errno;
+      ring_teardown(ring);
+      return err;
+    }
+
+    ring->cq_ring = single_mmap
+      ? ring->sq_ring
+      : mmap(NULL, ring->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      int err = -errno;
+      ring_teardown(ring);
+      return err;
+    }
+
+    void* sqes = mmap(NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      int err = -errno;
+      ring_teardown(ring);
+      return err;
+    }
+    ring->sqes = static_cast<io_uring_sqe*>(sqes);
+    ring->sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+
+    char* sq = static_cast<char*>(ring->sq_ring);
+    ring->sq_head    = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring->sq_tail    = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring->sq_mask    = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring->sq_array   = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    char* cq = static_cast<char*>(ring->cq_ring);
+    ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring->cqes    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return 0;
+  }
+
+  /**
+   * Checks the kernel supports every opcode the engine queues. OPENAT, READ, WRITE & CLOSE
+   * only arrived in 5.6, along with IORING_REGISTER_PROBE itself, so a failing probe
+   * means they're missing too.
+   *
+   * @returns Status code, where non-zero is the first unsupported opcode, or -errno.
+   */
+  static int ring_probe(const Ring* ring) {
+    const size_t num_ops = 256;
+    std::vector<png_byte> buffer(sizeof(io_uring_probe) + num_ops * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, num_ops) != 0) return -errno;
+
+    for (int opcode : { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED }) {
+      if (opcode > probe->last_op || !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) return opcode;
+    }
+    return 0;
+  }
+
+  /**
+   * Submits queued SQEs, waiting for at least wait_nr completions.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  static int ring_enter(Ring* ring, unsigned wait_nr, Counters& counters) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    while (true) {
+      int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+      counters.syscalls++;
+
+      if (submitted >= 0) {
+        counters.ops += submitted;
+        ring->to_submit -= submitted;
+        return 0;
+      }
+      if (errno != EINTR) return -errno;
+    }
+  }
+
+  static io_uring_sqe* ring_get_sqe(Ring* ring, Counters& counters) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    // Full, flush what's queued so far.
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+      if (ring_enter(ring, 0, counters) != 0) return nullptr;
+      head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+      if (ring->sq_local_tail - head >= ring->sq_entries) return nullptr;
+    }
+
+    unsigned index = ring->sq_local_tail & *ring->sq_mask;
+    io_uring_sqe* sqe = &ring->sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+  }
+
+  // Per file state machine: open -> read/write (possibly several) -> close.
+  enum class Stage {
+    Open,
+    Transfer,
+    Close,
+  };
+
+  struct FileOp {
+    size_t                index;
+    bool                  is_write = false;
+    Stage                 stage = Stage::Open;
+    int                   fd = -1;
+    int                   slot = -1;
+    std::vector<png_byte> data;
+    size_t                offset = 0;
+    int                   status = 0;
+  };
+
+  // Earliest job first, so workers follow the submitted order rather than read completion order.
+  struct EarliestJob {
+    bool operator()(const FileOp* a, const FileOp* b) const { return a->index > b->index; }
+  };
+
+  // Hand-off between the I/O thread and the workers.
+  struct WorkQueue {
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::priority_queue<FileOp*, std::vector<FileOp*>, EarliestJob> pending;
+    std::deque<FileOp*>     finished;
+    bool                    closing = false;
+    int                     event_fd;
+  };
+
+  // Tag for the eventfd read, which wakes the I/O thread when workers finish.
+  #define IO_EVENTFD_USER_DATA 1
+
+  // Engine state kept across batches, so a sharded run sets up its ring, slots & workers once.
+  struct Engine {
+    Options                  opts;
+    EngineType               type = EngineType::Blocking;
+    size_t                   workers = 0;
+    Counters                 counters;
+
+    // io_uring only.
+    Ring                     ring;
+    size_t                   queue_depth = 0;
+    png_byte*                slots = nullptr;
+    std::vector<iovec>       iovecs;
+    std::vector<int>         free_slots;
+    bool                     registered = false;
+    WorkQueue                queue;
+    uint64_t                 event_value = 0;
+    std::vector<std::thread> threads;
+
+    // Current batch, set before any of its jobs reach the workers.
+    const std::vector<Job>*  jobs = nullptr;
+    const ProcessFn*         process = nullptr;
+    bool                     drop_inputs = false;
+    bool                     ran_uring = false;
+  };
+
+  // Syscalls taken to map or unmap a ring, on top of setting it up or closing it.
+  static size_t ring_mmap_syscalls(const Ring& ring) {
+    return ring.cq_ring == ring.sq_ring ? 2 : 3;
+  }
+
+  static void uring_worker(Engine* e) {
+    std::vector<png_byte> out;
+
+    while (true) {
+      FileOp* op;
+      {
+        std::unique_lock<std::mutex> lock(e->queue.mutex);
+        e->queue.cv.wait(lock, [&]() { return e->queue.closing || !e->queue.pending.empty(); });
+        if (e->queue.pending.empty()) return;
+        op = e->queue.pending.top();
+        e->queue.pending.pop();
+      }
+
+      op->status = (*e->process)(op->index, (*e->jobs)[op->index], op->data, &out);
+      op->data.swap(out);
+
+      // Admitted jobs only hold what they reserved, so drop the input rather than keep it for reuse.
+      if (e->drop_inputs) std::vector<png_byte>().swap(out);
+
+      {
+        std::lock_guard<std::mutex> lock(e->queue.mutex);
+        e->queue.finished.push_back(op);
+      }
+
+      uint64_t one = 1;
+      if (write(e->queue.event_fd, &one, sizeof(one)) < 0) {
+        fmt::println("Failed to wake I/O thread: {}", std::strerror(errno));
+      }
+      e->counters.syscalls++;
+    }
+  }
+
+  static bool arm_eventfd(Engine* e) {
+    io_uring_sqe* sqe = ring_get_sqe(&e->ring, e->counters);
+    if (!sqe) return false;
+    sqe->opcode    = IORING_OP_READ;
+    sqe->fd        = e->queue.event_fd;
+    sqe->addr      = reinterpret_cast<uint64_t>(&e->event_value);
+    sqe->len       = sizeof(e->event_value);
+    sqe->user_data = IO_EVENTFD_USER_DATA;
+    return true;
+  }
+
+  // Stops the workers & releases the ring, leaving the engine to blocking I/O.
+  static void uring_close(Engine* e) {
+    {
+      std::lock_guard<std::mutex> lock(e->queue.mutex);
+      e->queue.closing = true;
+    }
+    e->queue.cv.notify_all();
+    for (std::thread& thread : e->threads) {
+      thread.join();
+    }
+    e->threads.clear();
+
+    // Tearing down the ring cancels the outstanding eventfd read.
+    if (e->ring.fd >= 0) e->counters.syscalls += 1 + ring_mmap_syscalls(e->ring);
+    ring_teardown(&e->ring);
+    if (e->queue.event_fd >= 0) {
+      close(e->queue.event_fd);
+      e->counters.syscalls++;
+      e->queue.event_fd = -1;
+    }
+    std::free(e->slots);
+    e->slots = nullptr;
+    e->type = EngineType::Blocking;
+  }
+
+  /**
+   * Sets up the ring, registered slots, eventfd & workers.
+   *
+   * @returns Status code, where non-zero means io_uring can't be used.
+   */
+  static int uring_open(Engine* e) {
+    e->queue_depth = std::max<size_t>(1, e->opts.queue_depth);
+
+    // Reads & writes are each bounded by the queue depth, plus the eventfd read.
+    unsigned entries = 1;
+    while (entries < 2 * e->queue_depth + e->workers + 1) entries <<= 1;
+
+    e->counters.syscalls++;
+    if (int err = ring_setup(&e->ring, entries); err != 0) {
+      fmt::println("io_uring unavailable ({}), falling back to blocking I/O", std::strerror(-err));
+      return err;
+    }
+    e->counters.syscalls += ring_mmap_syscalls(e->ring);
+
+    e->counters.syscalls++;
+    if (int err = ring_probe(&e->ring); err != 0) {
+      if (err < 0) fmt::println("io_uring probe unavailable ({}), falling back to blocking I/O", std::strerror(-err));
+      else fmt::println("io_uring lacks opcode {}, falling back to blocking I/O", err);
+      uring_close(e);
+      return -1;
+    }
+
+    // Registered buffers, one slot per in-flight file.
+    e->slots = static_cast<png_byte*>(std::aligned_alloc(4096, e->queue_depth * IO_URING_SLOT_BYTES));
+    if (!e->slots) {
+      fmt::println("Failed to allocate {}B of io_uring buffers, falling back to blocking I/O", e->queue_depth * IO_URING_SLOT_BYTES);
+      uring_close(e);
+      return -1;
+    }
+    e->iovecs.resize(e->queue_depth);
+    for (size_t i = 0; i < e->queue_depth; i++) {
+      e->iovecs[i] = { e->slots + i * IO_URING_SLOT_BYTES, IO_URING_SLOT_BYTES };
+      e->free_slots.push_back(e->queue_depth - 1 - i);
+    }
+
+    // Without registration (e.g. low RLIMIT_MEMLOCK) the slots still serve as plain buffers.
+    e->counters.syscalls++;
+    e->registered = syscall(__NR_io_uring_register, e->ring.fd, IORING_REGISTER_BUFFERS, e->iovecs.data(), e->queue_depth) == 0;
+    if (!e->registered) {
+      fmt::println("Failed to register io_uring buffers ({}), using unregistered buffers", std::strerror(errno));
+    }
+
+    e->counters.syscalls++;
+    e->queue.event_fd = eventfd(0, EFD_CLOEXEC);
+    if (e->queue.event_fd < 0 || !arm_eventfd(e)) {
+      fmt::println("Failed to set up io_uring wake ups ({}), falling back to blocking I/O", std::strerror(errno));
+      uring_close(e);
+      return -1;
+    }
+
+    e->queue.closing = false;
+    for (size_t i = 0; i < e->workers; i++) {
+      e->threads.emplace_back(uring_worker, e);
+    }
+    e->type = EngineType::Uring;
+    return 0;
+  }
+
+  // Queues the next operation of a file's state machine.
+  static bool queue_op(Engine* e, const std::vector<Job>& jobs, FileOp* op) {
+    io_uring_sqe* sqe = ring_get_sqe(&e->ring, e->counters);
+    if (!sqe) return false;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+
+    const Job& job = jobs[op->index];
+    switch (op->stage) {
+      case Stage::Open:
+        sqe->opcode     = IORING_OP_OPENAT;
+        sqe->fd         = AT_FDCWD;
+        sqe->addr       = reinterpret_cast<uint64_t>(op->is_write ? job.out_filepath.c_str() : job.in_filepath.c_str());
+        sqe->open_flags = op->is_write ? (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC);
+        sqe->len        = op->is_write ? 0644 : 0;
+        break;
+
+      case Stage::Transfer: {
+        sqe->fd  = op->fd;
+        sqe->off = op->offset;
+
+        // Registered slot first, anything past it goes straight from/to the heap buffer.
+        bool in_slot = op->slot >= 0 && op->offset == 0;
+        if (in_slot) {
+          sqe->opcode    = e->registered ? (op->is_write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED) : (op->is_write ? IORING_OP_WRITE : IORING_OP_READ);
+          sqe->addr      = reinterpret_cast<uint64_t>(e->iovecs[op->slot].iov_base);
+          sqe->len       = op->is_write ? op->data.size() : IO_URING_SLOT_BYTES;
+          sqe->buf_index = e->registered ? op->slot : 0;
+        } else if (op->is_write) {
+          sqe->opcode = IORING_OP_WRITE;
+          sqe->addr   = reinterpret_cast<uint64_t>(op->data.data() + op->offset);
+          sqe->len    = op->data.size() - op->offset;
+        } else {
+          // With the size known, allocate it exactly, plus a byte for the EOF read.
+          if (job.in_bytes >= op->offset && job.in_bytes > 0) {
+            op->data.reserve(job.in_bytes + 1);
+            op->data.resize(job.in_bytes + 1);
+          } else {
+            op->data.resize(op->offset + IO_SPILL_READ_BYTES);
+          }
+          sqe->opcode = IORING_OP_READ;
+          sqe->addr   = reinterpret_cast<uint64_t>(op->data.data() + op->offset);
+          sqe->len    = op->data.size() - op->offset;
+        }
+        break;
+      }
+
+      case Stage::Close:
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd     = op->fd;
+        break;
+    }
+    return true;
+  }
+
+  static int run_uring(Engine* e, const std::vector<Job>& jobs, const ProcessFn& process, const DoneFn& done, const Hooks& hooks) {
+    Ring& ring = e->ring;
+    Counters& counters = e->counters;
+    std::vector<int>& free_slots = e->free_slots;
+    std::vector<iovec>& iovecs = e->iovecs;
+    WorkQueue& queue = e->queue;
+    size_t queue_depth = e->queue_depth;
+    size_t workers = e->workers;
+
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      e->jobs        = &jobs;
+      e->process     = &process;
+      e->drop_inputs = bool(hooks.admit);
+    }
+    e->ran_uring = true;
+
+    size_t next_job = 0;
+    size_t completed = 0;
+    size_t reads_inflight = 0;
+    size_t writes_inflight = 0;
+    size_t buffered = 0;
+    int status = 0;
+
+    auto release_slot = [&](FileOp* op) {
+      if (op->slot >= 0) free_slots.push_back(op->slot);
+      op->slot = -1;
+    };
+
+    // Every job with a FileOp was admitted.
+    auto finish = [&](FileOp* op, int op_status) {
+      if (hooks.release) hooks.release(op->index);
+      done(op->index, op_status);
+      completed++;
+      delete op;
+    };
+
+    // Cancelled jobs count as completed, without a result.
+    auto drop = [&](FileOp* op) {
+      if (hooks.release) hooks.release(op->index);
+      completed++;
+      delete op;
+    };
+
+    while (completed < jobs.size() && status == 0) {
+      // Write out whatever the workers finished.
+      std::deque<FileOp*> finished;
+      {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        finished.swap(queue.finished);
+      }
+      for (FileOp* op : finished) {
+        buffered--;
+        if (op->status != 0) {
+          finish(op, op->status);
+          continue;
+        }
+        if (hooks.cancelled && hooks.cancelled()) {
+          drop(op);
+          continue;
+        }
+
+        op->is_write = true;
+        op->stage = Stage::Open;
+        op->offset = 0;
+
+        // Small outputs go through a registered slot when one is free.
+        if (op->data.size() <= IO_URING_SLOT_BYTES && !free_slots.empty()) {
+          op->slot = free_slots.back();
+          free_slots.pop_back();
+          std::memcpy(iovecs[op->slot].iov_base, op->data.data(), op->data.size());
+        }
+        if (!queue_op(e, jobs, op)) status = -1;
+        writes_inflight++;
+      }
+
+      // Keep the read side full, bounded by the queue depth & memory held by workers.
+      while (next_job < jobs.size() && reads_inflight < queue_depth && !free_slots.empty() &&
+             buffered + reads_inflight < queue_depth + workers) {
+        if (hooks.cancelled && hooks.cancelled()) {
+          completed += jobs.size() - next_job;
+          next_job = jobs.size();
+          break;
+        }
+
+        // Held jobs get asked again once a completion releases memory.
+        if (hooks.admit) {
+          Admission admission = hooks.admit(next_job);
+          if (admission == Admission::Wait) break;
+          if (admission == Admission::Reject) {
+            done(next_job++, -ENOMEM);
+            completed++;
+            continue;
+          }
+        }
+
+        FileOp* op = new FileOp();
+        op->index = next_job++;
+        op->slot = free_slots.back();
+        free_slots.pop_back();
+        if (!queue_op(e, jobs, op)) status = -1;
+        reads_inflight++;
+      }
+
+      // Everything left got cancelled, nothing to wait on.
+      if (completed == jobs.size()) break;
+
+      counters.sample_depth(reads_inflight + writes_inflight);
+      if (status != 0 || ring_enter(&ring, 1, counters) != 0) {
+        status = -1;
+        break;
+      }
+
+      // Reap completions.
+      unsigned head = *ring.cq_head;
+      unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++) {
+        io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+        int res = cqe->res;
+
+        if (cqe->user_data == IO_EVENTFD_USER_DATA) {
+          if (!arm_eventfd(e)) status = -1;
+          continue;
+        }
+
+        FileOp* op = reinterpret_cast<FileOp*>(cqe->user_data);
+        const Job& job = jobs[op->index];
+        const std::string& filepath = op->is_write ? job.out_filepath : job.in_filepath;
+
+        switch (op->stage) {
+          case Stage::Open:
+            if (res < 0) {
+              if (op->is_write) fmt::println("Failed write image to '{}': {}", filepath, std::strerror(-res));
+              else              fmt::println("Failed to open image '{}': {}", filepath, std::strerror(-res));
+              release_slot(op);
+              (op->is_write ? writes_inflight : reads_inflight)--;
+              finish(op, res);
+              continue;
+            }
+            op->fd = res;
+            op->stage = Stage::Transfer;
+            break;
+
+          case Stage::Transfer:
+            if (res < 0) {
+              fmt::println("Failed {} '{}': {}", op->is_write ? "writing" : "reading", filepath, std::strerror(-res));
+              op->status = res;
+              op->stage = Stage::Close;
+              break;
+            }
+
+            if (op->is_write) {
+              op->offset += res;
+              counters.bytes_written += res;
+
+              // A write making no progress would otherwise leave a truncated output behind a success.
+              if (res == 0 && op->offset < op->data.size()) {
+                fmt::println("Failed writing '{}': {}", filepath, std::strerror(EIO));
+                op->status = -EIO;
+              }
+              if (op->offset >= op->data.size() || res == 0) op->stage = Stage::Close;
+            } else {
+              // Copy out of the slot, then keep reading until EOF, as reads may come back short.
+              if (op->slot >= 0 && op->offset == 0) {
+                if (job.in_bytes > size_t(res)) op->data.reserve(job.in_bytes + 1);
+                op->data.assign(static_cast<png_byte*>(iovecs[op->slot].iov_base), static_cast<png_byte*>(iovecs[op->slot].iov_base) + res);
+              }
+              op->offset += res;
+              counters.bytes_read += res;
+
+              // Like the blocking engine, stop at the known size, saving the read that returns 0.
+              bool eof = res == 0 || (job.in_bytes > 0 && op->offset == job.in_bytes);
+              if (eof) {
+                op->data.resize(op->offset);
+                op->stage = Stage::Close;
+              }
+            }
+            break;
+
+          case Stage::Close:
+            release_slot(op);
+            if (op->is_write) {
+              // Filesystems such as NFS may only report write errors (ENOSPC, EDQUOT) on close.
+              if (res < 0 && op->status == 0) {
+                fmt::println("Failed write image to '{}': {}", filepath, std::strerror(-res));
+                op->status = res;
+              }
+              writes_inflight--;
+              finish(op, op->status);
+            } else {
+              reads_inflight--;
+              if (op->status != 0) {
+                finish(op, op->status);
+              } else {
+                buffered++;
+                std::lock_guard<std::mutex> lock(queue.mutex);
+                queue.pending.push(op);
+                queue.cv.notify_one();
+              }
+            }
+            continue;
+        }
+
+        if (!queue_op(e, jobs, op)) status = -1;
+      }
+      __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // A failed ring can't be trusted with later batches.
+    if (status != 0) {
+      fmt::println("io_uring engine failed");
+      uring_close(e);
+    }
+    return status;
+  }
+
+  int open_engine(const Options& opts, Engine** engine) {
+    Engine* e = new Engine();
+    e->opts    = opts;
+    e->workers = resolve_workers(opts.workers);
+
+    // Anything failing here leaves the engine on blocking I/O.
+    if (opts.engine == EngineType::Uring) uring_open(e);
+
+    *engine = e;
+    return 0;
+  }
+
+  int run_batch(Engine* engine, const std::vector<Job>& jobs, const ProcessFn& process, const DoneFn& done, const Hooks& hooks) {
+    if (engine->type == EngineType::Uring) {
+      return run_uring(engine, jobs, process, done, hooks);
+    }
+    return run_blocking(engine->opts, engine->counters, jobs, process, done, hooks);
+  }
+
+  void close_engine(Engine* engine, Stats* stats) {
+    if (engine->type == EngineType::Uring) uring_close(engine);
+
+    engine->counters.copy_to(stats);
+    stats->engine  = engine->ran_uring ? EngineType::Uring : EngineType::Blocking;
+    stats->workers = engine->workers;
+    delete engine;
+  }
+};
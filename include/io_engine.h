@@ -0,0 +1,145 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <libpng16/png.h>
+#include <string>
+#include <vector>
+
+// File I/O engines for batch runs. Inputs are read into memory, handed to worker threads
+// for decode/encode, and the results written back out.
+//  - Blocking: Workers do their own open/read/write/close.
+//  - Uring:    One I/O thread batch-submits opens, reads, writes and closes through io_uring,
+//              using registered buffers, overlapping with the workers' decode/encode.
+// Docs:
+//  - https://kernel.dk/io_uring.pdf
+namespace io {
+  enum class EngineType {
+    Blocking,
+    Uring,
+  };
+
+  // Registered buffer slot size. Files that don't fit spill over into regular reads/writes.
+  #define IO_URING_SLOT_BYTES (256 * 1024)
+
+  struct Options {
+    EngineType engine = EngineType::Uring;
+
+    // Decode/encode worker threads, 0 uses all cores.
+    size_t     workers = 0;
+
+    // Maximum number of files with I/O in flight.
+    size_t     queue_depth = 64;
+  };
+
+  // One input/output pair.
+  struct Job {
+    std::string in_filepath;
+    std::string out_filepath;
+
+    // Expected input size when known, so reads past the registered slot allocate it at once.
+    size_t      in_bytes = 0;
+  };
+
+  struct Stats {
+    // Engine that actually ran, after any fallback.
+    EngineType engine = EngineType::Blocking;
+    size_t     workers = 0;
+
+    size_t     syscalls = 0;
+    size_t     ops = 0;
+    size_t     bytes_read = 0;
+    size_t     bytes_written = 0;
+
+    // In-flight I/O operations, sampled at each submission.
+    size_t     max_queue_depth = 0;
+    double     avg_queue_depth = 0;
+  };
+
+  // Turns an input file's contents into the output file's contents, given the job's index.
+  // Returns a non-zero status on failure, in which case nothing gets written.
+  using ProcessFn = std::function<int(size_t index, const Job& job, const std::vector<png_byte>& in, std::vector<png_byte>* out)>;
+
+  // Reports a job's result given its index & status. Calls are serialized.
+  using DoneFn = std::function<void(size_t index, int status)>;
+
+  // Checked before each job's read & write, possibly from several threads. Once it returns
+  // true, the remaining jobs are dropped without being written or reported through done.
+  using CancelFn = std::function<bool()>;
+
+  // Whether a job's input may be read yet.
+  enum class Admission {
+    // Read it now.
+    Admit,
+
+    // Hold it, along with every job after it, until an admitted job finishes.
+    Wait,
+
+    // Fail it without reading, reported through done with -ENOMEM.
+    Reject,
+  };
+
+  // Decides a job's admission given its index, asked again after a Wait once another job finishes.
+  // Jobs are asked in order. Wait must only be returned while some admitted job is still in flight.
+  using AdmitFn = std::function<Admission(size_t index)>;
+
+  // Called once an admitted job finished or got cancelled, given its index, before its done call.
+  using ReleaseFn = std::function<void(size_t index)>;
+
+  // Optional hooks into a batch run. Admit & release calls are serialized.
+  struct Hooks {
+    CancelFn  cancelled;
+    AdmitFn   admit;
+    ReleaseFn release;
+  };
+
+  /**
+   * Parses an engine name.
+   *
+   * @param name Either 'blocking' or 'uring'
+   * @param engine Engine pointer for which to populate.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int parse_engine(const std::string& name, EngineType* engine);
+
+  /**
+   * Returns the engine's name.
+   */
+  const char* engine_name(EngineType engine);
+
+  // Engine state kept across batches, see open_engine.
+  struct Engine;
+
+  /**
+   * Sets up an engine, ring, buffers and worker threads included, to be reused by every batch
+   * of a run. Falls back to the blocking engine when io_uring isn't available.
+   *
+   * @param opts Engine options
+   * @param engine Engine pointer for which to populate, to be freed with close_engine.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int open_engine(const Options& opts, Engine** engine);
+
+  /**
+   * Reads, processes and writes every job. An io_uring engine that fails
+   * switches to the blocking engine for later batches.
+   *
+   * @param engine Engine from open_engine
+   * @param jobs Jobs to run, in submission order
+   * @param process Function processing a job's contents, called on worker threads
+   * @param done Function called once per job with its result, unless the job got cancelled
+   * @param hooks Optional cancellation & admission hooks
+   *
+   * @returns Status code, where non-zero means the engine itself failed.
+   */
+  int run_batch(Engine* engine, const std::vector<Job>& jobs, const ProcessFn& process, const DoneFn& done, const Hooks& hooks);
+
+  /**
+   * Tears down an engine.
+   *
+   * @param engine Engine from open_engine
+   * @param stats Stats pointer for which to populate, covering every batch plus the setup & teardown.
+   */
+  void close_engine(Engine* engine, Stats* stats);
+};
@@ -0,0 +1,190 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csetjmp>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <time.h>
+#include <zlib.h>
+
+#include "optimize.h"
+
+
+namespace optimize {
+  // Most promising candidates first, so the bar to beat drops early.
+  static const Candidate CANDIDATES[] = {
+    { PNG_ALL_FILTERS,    9, Z_FILTERED },
+    { PNG_FILTER_PAETH,   9, Z_FILTERED },
+    { PNG_ALL_FILTERS,    9, Z_DEFAULT_STRATEGY },
+    { PNG_FILTER_PAETH,   9, Z_DEFAULT_STRATEGY },
+    { PNG_FILTER_UP,      9, Z_FILTERED },
+    { PNG_FILTER_SUB,     9, Z_FILTERED },
+    { PNG_FILTER_AVG,     9, Z_FILTERED },
+    { PNG_FILTER_NONE,    9, Z_DEFAULT_STRATEGY },
+    { PNG_FILTER_UP,      9, Z_DEFAULT_STRATEGY },
+    { PNG_FILTER_SUB,     9, Z_DEFAULT_STRATEGY },
+    { PNG_FILTER_AVG,     9, Z_DEFAULT_STRATEGY },
+    { PNG_ALL_FILTERS,    9, Z_RLE },
+    { PNG_FILTER_PAETH,   9, Z_RLE },
+    { PNG_FILTER_UP,      9, Z_RLE },
+    { PNG_FILTER_SUB,     9, Z_RLE },
+    { PNG_FILTER_NONE,    9, Z_RLE },
+    { PNG_ALL_FILTERS,    6, Z_FILTERED },
+    { PNG_FILTER_NONE,    6, Z_DEFAULT_STRATEGY },
+  };
+
+  // Writes into memory, abandoning the encode once it can no longer win.
+  struct TrialWriter {
+    std::vector<png_byte>*     out;
+    const std::atomic<size_t>* best_size_bytes;
+    bool                       abandoned;
+  };
+
+  static void trial_write_fn(png_structp png_ptr, png_bytep data, png_size_t len) {
+    TrialWriter* writer = static_cast<TrialWriter*>(png_get_io_ptr(png_ptr));
+    if (writer->out->size() + len > writer->best_size_bytes->load(std::memory_order_relaxed)) {
+      writer->abandoned = true;
+      png_error(png_ptr, "Candidate abandoned");
+    }
+    writer->out->insert(writer->out->end(), data, data + len);
+  }
+
+  static void trial_flush_fn(png_structp) {}
+
+  // Abandoned trials are expected, so skip libpng's default error printing.
+  static void trial_error_fn(png_structp png_ptr, png_const_charp) {
+    png_longjmp(png_ptr, 1);
+  }
+
+  static void trial_warning_fn(png_structp, png_const_charp) {}
+
+  static double thread_cpu_seconds() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  /**
+   * Encodes one candidate. A null candidate uses libpng's defaults, same as write_png_file.
+   *
+   * @returns Status code, where 0 is success, 1 is abandoned, and negative means failure.
+   */
+  static int encode_candidate(const Candidate* candidate, png_uint_32 width, png_uint_32 height, png_bytepp row_pointers, TrialWriter* writer) {
+    writer->out->clear();
+    writer->abandoned = false;
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, trial_error_fn, trial_warning_fn);
+    if (!png_ptr) return -1;
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+      png_destroy_write_struct(&png_ptr, NULL);
+      return -1;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      return writer->abandoned ? 1 : -1;
+    }
+
+    png_set_write_fn(png_ptr, writer, trial_write_fn, trial_flush_fn);
+    png_set_IHDR(
+      png_ptr,
+      info_ptr,
+      width, height,
+      8,
+      PNG_COLOR_TYPE_RGBA,
+      PNG_INTERLACE_NONE,
+      PNG_COMPRESSION_TYPE_DEFAULT,
+      PNG_FILTER_TYPE_DEFAULT
+    );
+
+    if (candidate) {
+      png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, candidate->filters);
+      png_set_compression_level(png_ptr, candidate->level);
+      png_set_compression_strategy(png_ptr, candidate->strategy);
+      png_set_compression_mem_level(png_ptr, 9);
+    }
+
+    png_set_rows(png_ptr, info_ptr, row_pointers);
+    png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return 0;
+  }
+
+  int encode_smallest(png_uint_32 width, png_uint_32 height, png_bytepp row_pointers, size_t workers, std::vector<png_byte>* out, Stats* stats) {
+    auto wall_start = std::chrono::steady_clock::now();
+    double cpu_start = thread_cpu_seconds();
+
+    // Default encode first, which is the baseline to beat.
+    std::atomic<size_t> best_size_bytes = std::numeric_limits<size_t>::max();
+    TrialWriter writer = { out, &best_size_bytes, false };
+    if (encode_candidate(nullptr, width, height, row_pointers, &writer) != 0) {
+      return -1;
+    }
+    best_size_bytes = out->size();
+    stats->default_size_bytes = out->size();
+    double default_cpu_seconds = thread_cpu_seconds() - cpu_start;
+
+    size_t num_candidates = sizeof(CANDIDATES) / sizeof(CANDIDATES[0]);
+    if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min(workers, num_candidates);
+
+    std::atomic<size_t> next_candidate = 0;
+    std::atomic<size_t> abandoned = 0;
+    std::atomic<bool>   failed = false;
+    std::mutex best_mutex;
+    ssize_t best_candidate = -1;
+    double worker_cpu_seconds = 0;
+
+    auto worker = [&]() {
+      double worker_cpu_start = thread_cpu_seconds();
+      std::vector<png_byte> trial;
+      TrialWriter trial_writer = { &trial, &best_size_bytes, false };
+
+      for (size_t i = next_candidate++; i < num_candidates && !failed; i = next_candidate++) {
+        int status = encode_candidate(&CANDIDATES[i], width, height, row_pointers, &trial_writer);
+        if (status < 0) {
+          failed = true;
+          break;
+        }
+        if (status == 1) {
+          abandoned++;
+          continue;
+        }
+
+        // Another worker may have finished a smaller stream in the meantime.
+        std::lock_guard<std::mutex> lock(best_mutex);
+        if (trial.size() < out->size()) {
+          out->swap(trial);
+          best_size_bytes = out->size();
+          best_candidate = i;
+        }
+      }
+
+      std::lock_guard<std::mutex> lock(best_mutex);
+      worker_cpu_seconds += thread_cpu_seconds() - worker_cpu_start;
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    if (failed) return -1;
+
+    stats->cpu_seconds     = default_cpu_seconds + worker_cpu_seconds;
+    stats->wall_seconds    = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+    stats->best_size_bytes = out->size();
+    stats->candidates      = num_candidates;
+    stats->abandoned       = abandoned;
+    stats->workers         = workers;
+    stats->best            = best_candidate >= 0 ? CANDIDATES[best_candidate] : Candidate{ PNG_ALL_FILTERS, Z_DEFAULT_COMPRESSION, Z_FILTERED };
+    return 0;
+  }
+};
@@ -0,0 +1,46 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <libpng16/png.h>
+#include <vector>
+
+// Size-optimizing encoder. Tries filter heuristics along with zlib strategy/level
+// combinations across worker threads and keeps the smallest stream.
+namespace optimize {
+  // One filter/zlib combination to trial.
+  struct Candidate {
+    int filters;  // PNG_FILTER_* mask, where multiple filters select per row adaptively.
+    int level;    // zlib compression level.
+    int strategy; // zlib strategy.
+  };
+
+  // Results of an optimized encode.
+  struct Stats {
+    size_t default_size_bytes = 0;
+    size_t best_size_bytes    = 0;
+    size_t candidates         = 0;
+    size_t abandoned          = 0;
+    size_t workers            = 0;
+    Candidate best;
+
+    // CPU time across all workers and wall time, in seconds.
+    double cpu_seconds  = 0;
+    double wall_seconds = 0;
+  };
+
+  /**
+   * Encodes 8bit RGBA rows into the smallest PNG stream found.
+   * The libpng default encode is always run first and seeds the size to beat,
+   * any candidate growing past the current best is abandoned mid-stream.
+   *
+   * @param width Image width
+   * @param height Image height
+   * @param row_pointers PNG pixels, in 8bit RGBA
+   * @param workers Number of worker threads, 0 uses all cores
+   * @param out Buffer for which to populate with the smallest PNG.
+   * @param stats Stats pointer for which to populate
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int encode_smallest(png_uint_32 width, png_uint_32 height, png_bytepp row_pointers, size_t workers, std::vector<png_byte>* out, Stats* stats);
+};
@@ -0,0 +1,83 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fmt/core.h>
+#include <fmt/format.h>
+
+#include "png_io.h"
+
+
+namespace png_io {
+  void buffer_read_fn(png_structp png_ptr, png_bytep out, png_size_t len) {
+    BufferReader* reader = static_cast<BufferReader*>(png_get_io_ptr(png_ptr));
+    if (reader->offset + len > reader->buffer->size()) {
+      png_error(png_ptr, "Read past end of image buffer");
+    }
+    std::memcpy(out, reader->buffer->data() + reader->offset, len);
+    reader->offset += len;
+  }
+
+  void buffer_write_fn(png_structp png_ptr, png_bytep data, png_size_t len) {
+    std::vector<png_byte>* out = static_cast<std::vector<png_byte>*>(png_get_io_ptr(png_ptr));
+    out->insert(out->end(), data, data + len);
+  }
+
+  void buffer_flush_fn(png_structp) {}
+
+  void read_rgba_info(png_structp png_ptr, png_infop info_ptr) {
+    png_read_info(png_ptr, info_ptr);
+
+    // Configure color types.
+    png_byte color_type = png_get_color_type(png_ptr, info_ptr);
+    png_byte bit_depth  = png_get_bit_depth(png_ptr, info_ptr);
+
+    // Read any color_type into 8bit depth, RGBA format.
+    // See http://www.libpng.org/pub/png/libpng-manual.txt
+
+    if(bit_depth == 16)
+      png_set_strip_16(png_ptr);
+
+    if(color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_palette_to_rgb(png_ptr);
+
+    // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
+    if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+      png_set_expand_gray_1_2_4_to_8(png_ptr);
+
+    if(png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+      png_set_tRNS_to_alpha(png_ptr);
+
+    // These color_type don't have an alpha channel then fill it with 0xff.
+    if(color_type == PNG_COLOR_TYPE_RGB ||
+       color_type == PNG_COLOR_TYPE_GRAY ||
+       color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_filler(png_ptr, 0xFF, PNG_FILLER_AFTER);
+
+    if(color_type == PNG_COLOR_TYPE_GRAY ||
+       color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+      png_set_gray_to_rgb(png_ptr);
+
+    // Interlaced images need all passes handled by libpng.
+    png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+  }
+
+  int write_file(const std::string& filepath, const std::vector<png_byte>& encoded) {
+    // Check if we're outputing to stdout.
+    bool use_stdout = filepath == "-";
+    FILE* fp = use_stdout ? stdout : fopen(filepath.c_str(), "wb");
+    if (!fp) {
+      fmt::println("Failed write image to '{}': Failed to open file: {}", filepath, std::strerror(errno));
+      return 1;
+    }
+
+    size_t written = fwrite(encoded.data(), 1, encoded.size(), fp);
+    if (!use_stdout) fclose(fp);
+
+    if (written != encoded.size()) {
+      fmt::println("Failed write image to '{}': Short write", filepath);
+      return 1;
+    }
+    return 0;
+  }
+};
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <libpng16/png.h>
+#include <string>
+#include <vector>
+
+// libpng plumbing shared by the still image, animated & quantized paths: in-memory IO,
+// the 8bit RGBA read expansion, and writing encoded images out.
+namespace png_io {
+  // In-memory PNG source, for use with png_set_read_fn & buffer_read_fn.
+  struct BufferReader {
+    const std::vector<png_byte>* buffer;
+    size_t                       offset;
+  };
+
+  /**
+   * libpng read callback, reading from a BufferReader set as the IO pointer.
+   * Reads past the end raise a libpng error.
+   */
+  void buffer_read_fn(png_structp png_ptr, png_bytep out, png_size_t len);
+
+  /**
+   * libpng write callback, appending to a std::vector<png_byte> set as the IO pointer.
+   */
+  void buffer_write_fn(png_structp png_ptr, png_bytep data, png_size_t len);
+
+  /**
+   * libpng flush callback, a no-op for buffers.
+   */
+  void buffer_flush_fn(png_structp png_ptr);
+
+  /**
+   * Reads the PNG's info, setting up the transforms which expand any row into 8bit RGBA,
+   * interlaced images included.
+   *
+   * @param png_ptr Pointer to the PNG image struct, with its IO set up
+   * @param info_ptr Pointer to the PNG image info struct
+   */
+  void read_rgba_info(png_structp png_ptr, png_infop info_ptr);
+
+  /**
+   * Writes an already encoded image.
+   *
+   * @param filepath Resulting image path. '-' writes to stdout
+   * @param encoded Encoded image
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int write_file(const std::string& filepath, const std::vector<png_byte>& encoded);
+};
@@ -0,0 +1,386 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "png_io.h"
+#include "quantize.h"
+
+
+namespace quantize {
+  using Color = std::array<png_byte, 4>;
+
+  // Histogram bucket. Channel sums are kept so palette entries are exact means.
+  struct Bucket {
+    uint64_t count = 0;
+    uint64_t sum[4] = { 0, 0, 0, 0 };
+  };
+
+  // Histogram shared by every row band.
+  struct Histogram {
+    std::mutex                             mutex;
+    std::unordered_map<uint32_t, Bucket>   buckets;
+
+    // Exact colors, tracked until there are more than the palette holds.
+    std::unordered_set<uint32_t>           exact;
+    bool                                   exact_overflow = false;
+
+    // Fully transparent pixels, which get their own palette entry.
+    bool                                   has_transparent = false;
+  };
+
+  // Median cut box over a range of histogram entries.
+  struct Box {
+    size_t begin;
+    size_t end;
+    int    channel;
+
+    // Squared error along the channel, the box with the most gets split first.
+    double score;
+  };
+
+  static uint32_t pack(const png_byte* px) {
+    return uint32_t(px[0]) | uint32_t(px[1]) << 8 | uint32_t(px[2]) << 16 | uint32_t(px[3]) << 24;
+  }
+
+  static Color unpack(uint32_t key) {
+    return { png_byte(key), png_byte(key >> 8), png_byte(key >> 16), png_byte(key >> 24) };
+  }
+
+  static uint32_t bucket_of(const png_byte* px) {
+    const int shift = 8 - QUANTIZE_BUCKET_BITS;
+    return uint32_t(px[0] >> shift)
+      | uint32_t(px[1] >> shift) << QUANTIZE_BUCKET_BITS
+      | uint32_t(px[2] >> shift) << (2 * QUANTIZE_BUCKET_BITS)
+      | uint32_t(px[3] >> shift) << (3 * QUANTIZE_BUCKET_BITS);
+  }
+
+  /**
+   * Runs fn(y0, y1) over every row band across the worker threads.
+   */
+  template<typename Fn>
+  static void for_each_band(size_t workers, png_uint_32 height, Fn fn) {
+    size_t bands = (height + QUANTIZE_BAND_ROWS - 1) / QUANTIZE_BAND_ROWS;
+    std::atomic<size_t> next_band = 0;
+
+    auto worker = [&]() {
+      for (size_t band = next_band++; band < bands; band = next_band++) {
+        png_uint_32 y0 = band * QUANTIZE_BAND_ROWS;
+        fn(y0, std::min<png_uint_32>(height, y0 + QUANTIZE_BAND_ROWS));
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < workers; i++) {
+      threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+  }
+
+  /**
+   * Histograms a band locally, then merges it into the shared histogram.
+   */
+  static void histogram_band(png_uint_32 width, png_uint_32 y0, png_uint_32 y1, png_bytepp row_pointers, size_t colors, Histogram* histogram) {
+    std::unordered_map<uint32_t, Bucket> buckets;
+    std::unordered_set<uint32_t> exact;
+    bool exact_overflow = false;
+    bool has_transparent = false;
+
+    for (png_uint_32 y = y0; y < y1; y++) {
+      png_bytep row = row_pointers[y];
+      for (png_uint_32 x = 0; x < width; x++) {
+        png_bytep px = &row[x * 4];
+        if (px[3] == 0) {
+          has_transparent = true;
+          continue;
+        }
+
+        if (!exact_overflow) {
+          exact.insert(pack(px));
+          exact_overflow = exact.size() > colors;
+        }
+
+        Bucket& bucket = buckets[bucket_of(px)];
+        bucket.count++;
+        for (int c = 0; c < 4; c++) bucket.sum[c] += px[c];
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(histogram->mutex);
+    for (const auto& [key, bucket] : buckets) {
+      Bucket& shared = histogram->buckets[key];
+      shared.count += bucket.count;
+      for (int c = 0; c < 4; c++) shared.sum[c] += bucket.sum[c];
+    }
+
+    histogram->has_transparent |= has_transparent;
+    histogram->exact_overflow |= exact_overflow;
+    if (!histogram->exact_overflow) {
+      histogram->exact.insert(exact.begin(), exact.end());
+      histogram->exact_overflow = histogram->exact.size() > colors;
+    }
+  }
+
+  static double mean_of(const Bucket& bucket, int channel) {
+    return double(bucket.sum[channel]) / bucket.count;
+  }
+
+  static Box make_box(const std::vector<Bucket>& entries, size_t begin, size_t end) {
+    Box box = { begin, end, 0, 0 };
+    if (end - begin < 2) return box;
+
+    for (int c = 0; c < 4; c++) {
+      double count = 0, sum = 0, sum_sq = 0;
+      for (size_t i = begin; i < end; i++) {
+        double mean = mean_of(entries[i], c);
+        count  += entries[i].count;
+        sum    += mean * entries[i].count;
+        sum_sq += mean * mean * entries[i].count;
+      }
+
+      double error = sum_sq - sum * sum / count;
+      if (error > box.score) {
+        box.score = error;
+        box.channel = c;
+      }
+    }
+    return box;
+  }
+
+  /**
+   * Reduces the histogram's buckets to at most the given number of colors through median cut.
+   */
+  static std::vector<Color> median_cut(const Histogram& histogram, size_t colors) {
+    // Sorted keys, so the result doesn't depend on the order bands were merged in.
+    std::vector<uint32_t> keys;
+    keys.reserve(histogram.buckets.size());
+    for (const auto& entry : histogram.buckets) keys.push_back(entry.first);
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<Bucket> entries;
+    entries.reserve(keys.size());
+    for (uint32_t key : keys) entries.push_back(histogram.buckets.at(key));
+
+    std::vector<Box> boxes = { make_box(entries, 0, entries.size()) };
+    while (boxes.size() < colors) {
+      auto widest = std::max_element(boxes.begin(), boxes.end(), [](const Box& a, const Box& b) { return a.score < b.score; });
+      if (widest->score <= 0) break;
+
+      // Split at the weighted median along the channel with the most error.
+      Box box = *widest;
+      std::stable_sort(entries.begin() + box.begin, entries.begin() + box.end, [&](const Bucket& a, const Bucket& b) {
+        return mean_of(a, box.channel) < mean_of(b, box.channel);
+      });
+
+      uint64_t total = 0;
+      for (size_t i = box.begin; i < box.end; i++) total += entries[i].count;
+
+      size_t split = box.begin + 1;
+      for (uint64_t seen = entries[box.begin].count; split < box.end - 1 && seen * 2 < total; split++) {
+        seen += entries[split].count;
+      }
+
+      *widest = make_box(entries, box.begin, split);
+      boxes.push_back(make_box(entries, split, box.end));
+    }
+
+    std::vector<Color> palette;
+    for (const Box& box : boxes) {
+      Bucket merged;
+      for (size_t i = box.begin; i < box.end; i++) {
+        merged.count += entries[i].count;
+        for (int c = 0; c < 4; c++) merged.sum[c] += entries[i].sum[c];
+      }
+
+      Color color;
+      for (int c = 0; c < 4; c++) color[c] = png_byte((merged.sum[c] + merged.count / 2) / merged.count);
+      palette.push_back(color);
+    }
+    return palette;
+  }
+
+  static png_byte nearest(const std::vector<Color>& palette, const int px[4]) {
+    size_t best = 0;
+    int best_distance = INT32_MAX;
+    for (size_t i = 0; i < palette.size(); i++) {
+      int distance = 0;
+      for (int c = 0; c < 4; c++) {
+        int d = px[c] - palette[i][c];
+        distance += d * d;
+      }
+      if (distance < best_distance) {
+        best_distance = distance;
+        best = i;
+      }
+    }
+    return png_byte(best);
+  }
+
+  /**
+   * Maps a band's pixels to palette indices, diffusing the error within the band when dithering.
+   */
+  static void map_band(png_uint_32 width, png_uint_32 y0, png_uint_32 y1, png_bytepp row_pointers, const std::vector<Color>& palette,
+                       bool has_transparent, bool dither, std::vector<png_byte>* indices) {
+    // Nearest entry per exact color, local to the worker.
+    std::unordered_map<uint32_t, png_byte> cache;
+    auto lookup = [&](const int px[4]) {
+      png_byte key[4] = { png_byte(px[0]), png_byte(px[1]), png_byte(px[2]), png_byte(px[3]) };
+      auto [it, inserted] = cache.try_emplace(pack(key), 0);
+      if (inserted) it->second = nearest(palette, px);
+      return it->second;
+    };
+
+    // Error rows in 1/16ths, padded by a pixel on each side.
+    std::vector<int> error(dither ? (width + 2) * 4 : 0);
+    std::vector<int> next_error(error.size());
+
+    for (png_uint_32 y = y0; y < y1; y++) {
+      png_bytep row = row_pointers[y];
+      png_bytep out = &(*indices)[size_t(y) * width];
+
+      for (png_uint_32 x = 0; x < width; x++) {
+        png_bytep px = &row[x * 4];
+
+        // Fully transparent pixels map to their own entry, which leads the palette.
+        if (px[3] == 0 && has_transparent) {
+          out[x] = 0;
+          continue;
+        }
+
+        int value[4];
+        for (int c = 0; c < 4; c++) {
+          value[c] = px[c];
+          if (dither) value[c] = std::clamp(value[c] + error[(x + 1) * 4 + c] / 16, 0, 255);
+        }
+
+        png_byte index = lookup(value);
+        out[x] = index;
+
+        if (dither) {
+          for (int c = 0; c < 4; c++) {
+            int diff = value[c] - palette[index][c];
+            error[(x + 2) * 4 + c]      += diff * 7;
+            next_error[x * 4 + c]       += diff * 3;
+            next_error[(x + 1) * 4 + c] += diff * 5;
+            next_error[(x + 2) * 4 + c] += diff * 1;
+          }
+        }
+      }
+
+      if (dither) {
+        error.swap(next_error);
+        std::fill(next_error.begin(), next_error.end(), 0);
+      }
+    }
+  }
+
+  int quantize(png_uint_32 width, png_uint_32 height, png_bytepp row_pointers, const Options& opts, IndexedImage* out, Stats* stats) {
+    auto start = std::chrono::steady_clock::now();
+    size_t colors = std::clamp<size_t>(opts.colors, 2, QUANTIZE_MAX_COLORS);
+
+    size_t workers = opts.workers;
+    if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    workers = std::min<size_t>(workers, std::max<size_t>(1, (height + QUANTIZE_BAND_ROWS - 1) / QUANTIZE_BAND_ROWS));
+
+    Histogram histogram;
+    for_each_band(workers, height, [&](png_uint_32 y0, png_uint_32 y1) {
+      histogram_band(width, y0, y1, row_pointers, colors, &histogram);
+    });
+
+    // Few enough colors to keep every one of them, otherwise reduce the buckets.
+    size_t reserved = histogram.has_transparent ? 1 : 0;
+    bool lossless = !histogram.exact_overflow && histogram.exact.size() + reserved <= colors;
+
+    std::vector<Color> palette;
+    if (lossless) {
+      std::vector<uint32_t> keys(histogram.exact.begin(), histogram.exact.end());
+      std::sort(keys.begin(), keys.end());
+      for (uint32_t key : keys) palette.push_back(unpack(key));
+    } else {
+      palette = median_cut(histogram, colors - reserved);
+    }
+
+    // Translucent entries first, so tRNS stops at the last of them.
+    std::stable_sort(palette.begin(), palette.end(), [](const Color& a, const Color& b) { return a[3] < b[3]; });
+    if (histogram.has_transparent) palette.insert(palette.begin(), Color{ 0, 0, 0, 0 });
+    if (palette.empty()) palette.push_back(Color{ 0, 0, 0, 0 });
+
+    out->width  = width;
+    out->height = height;
+    out->indices.resize(size_t(width) * height);
+    for_each_band(workers, height, [&](png_uint_32 y0, png_uint_32 y1) {
+      map_band(width, y0, y1, row_pointers, palette, histogram.has_transparent, opts.dither && !lossless, &out->indices);
+    });
+
+    out->palette.clear();
+    out->alpha.clear();
+    for (const Color& color : palette) {
+      out->palette.push_back({ color[0], color[1], color[2] });
+      if (color[3] != 255) out->alpha.push_back(color[3]);
+    }
+
+    stats->colors         = lossless ? histogram.exact.size() + reserved : histogram.buckets.size() + reserved;
+    stats->palette_colors = palette.size();
+    stats->lossless       = lossless;
+    stats->workers        = workers;
+    stats->seconds        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return 0;
+  }
+
+  // Smallest PNG bit depth holding the palette's indices.
+  static int bit_depth_for(size_t entries) {
+    return entries <= 2 ? 1 : entries <= 4 ? 2 : entries <= 16 ? 4 : 8;
+  }
+
+  int encode_indexed(const IndexedImage& img, std::vector<png_byte>* out) {
+    out->clear();
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!png_ptr) return -1;
+
+    png_infop info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr) {
+      png_destroy_write_struct(&png_ptr, NULL);
+      return -1;
+    }
+
+    if (setjmp(png_jmpbuf(png_ptr))) {
+      png_destroy_write_struct(&png_ptr, &info_ptr);
+      return -1;
+    }
+
+    png_set_write_fn(png_ptr, out, png_io::buffer_write_fn, png_io::buffer_flush_fn);
+    png_set_IHDR(
+      png_ptr,
+      info_ptr,
+      img.width, img.height,
+      bit_depth_for(img.palette.size()),
+      PNG_COLOR_TYPE_PALETTE,
+      PNG_INTERLACE_NONE,
+      PNG_COMPRESSION_TYPE_DEFAULT,
+      PNG_FILTER_TYPE_DEFAULT
+    );
+    png_set_PLTE(png_ptr, info_ptr, img.palette.data(), img.palette.size());
+    if (!img.alpha.empty()) {
+      png_set_tRNS(png_ptr, info_ptr, img.alpha.data(), img.alpha.size(), NULL);
+    }
+    png_write_info(png_ptr, info_ptr);
+
+    // Rows hold one index per byte, packed down to the bit depth on write.
+    png_set_packing(png_ptr);
+    for (png_uint_32 y = 0; y < img.height; y++) {
+      png_write_row(png_ptr, &img.indices[size_t(y) * img.width]);
+    }
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return 0;
+  }
+};
@@ -0,0 +1,78 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <libpng16/png.h>
+#include <vector>
+
+// Palette quantizer, reducing 8bit RGBA rows to an indexed PNG with tRNS alpha.
+// Row bands are histogrammed in parallel into a shared histogram, reduced through
+// median cut and mapped back in parallel, optionally with Floyd-Steinberg dithering.
+// Images with no more distinct colors than the palette holds are indexed losslessly.
+namespace quantize {
+  #define QUANTIZE_MAX_COLORS 256
+
+  // Histogram buckets keep the top 5 bits of each channel.
+  #define QUANTIZE_BUCKET_BITS 5
+
+  // Rows per band handed to a worker.
+  #define QUANTIZE_BAND_ROWS 64
+
+  struct Options {
+    // Palette size, between 2 and QUANTIZE_MAX_COLORS.
+    size_t colors = QUANTIZE_MAX_COLORS;
+
+    // Floyd-Steinberg error diffusion, within each row band.
+    bool   dither = false;
+
+    // Worker threads, 0 uses all cores.
+    size_t workers = 0;
+  };
+
+  // Indexed image, one palette index byte per pixel.
+  struct IndexedImage {
+    png_uint_32             width = 0;
+    png_uint_32             height = 0;
+
+    // Translucent entries come first, so tRNS only covers them.
+    std::vector<png_color>  palette;
+    std::vector<png_byte>   alpha;
+
+    std::vector<png_byte>   indices;
+  };
+
+  // Results of a quantization.
+  struct Stats {
+    // Distinct colors in the source, or histogram buckets when there were more than the palette holds.
+    size_t colors         = 0;
+    size_t palette_colors = 0;
+    bool   lossless       = false;
+    size_t workers        = 0;
+    double seconds        = 0;
+  };
+
+  /**
+   * Quantizes 8bit RGBA rows down to a palette. Fully transparent pixels keep a
+   * dedicated palette entry, so masked corners stay exact.
+   *
+   * @param width Image width
+   * @param height Image height
+   * @param row_pointers PNG pixels, in 8bit RGBA
+   * @param opts Quantization options
+   * @param out Indexed image for which to populate.
+   * @param stats Stats pointer for which to populate
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int quantize(png_uint_32 width, png_uint_32 height, png_bytepp row_pointers, const Options& opts, IndexedImage* out, Stats* stats);
+
+  /**
+   * Encodes an indexed image as a PNG with PLTE & tRNS chunks, at the smallest
+   * bit depth holding the palette.
+   *
+   * @param img Indexed image
+   * @param out Buffer for which to populate.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int encode_indexed(const IndexedImage& img, std::vector<png_byte>* out);
+};
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <netinet/in.h>
+#include <numeric>
+
+#include "png.h"
+#include "schedule.h"
+
+
+namespace schedule {
+  // Samples per pixel of each PNG color type.
+  static size_t channels_of(uint8_t color_type) {
+    switch (color_type) {
+      case 0: return 1; // Grayscale
+      case 2: return 3; // RGB
+      case 3: return 1; // Palette
+      case 4: return 2; // Grayscale & alpha
+      case 6: return 4; // RGBA
+      default: return 4;
+    }
+  }
+
+  int parse_policy(const std::string& name, Policy* policy) {
+    if (name == "fifo") {
+      *policy = Policy::Fifo;
+    } else if (name == "largest") {
+      *policy = Policy::LargestFirst;
+    } else if (name == "shortest") {
+      *policy = Policy::ShortestFirst;
+    } else {
+      return -1;
+    }
+    return 0;
+  }
+
+  const char* policy_name(Policy policy) {
+    switch (policy) {
+      case Policy::LargestFirst:  return "largest";
+      case Policy::ShortestFirst: return "shortest";
+      default:                    return "fifo";
+    }
+  }
+
+  int estimate_file(const std::string& filepath, Estimate* estimate) {
+    *estimate = Estimate{};
+
+    std::ifstream img_if;
+    img_if.open(filepath, std::ios::binary | std::ios::in);
+    if (!img_if.is_open()) return -1;
+
+    png::ImageChunk chunk;
+    if (png::_parse_img_chunk(img_if, &chunk) != 0 || !img_if) {
+      return -1;
+    }
+
+    // Walk the chunk headers up to the image data, acTL must come before it.
+    uint32_t chunk_hdr[2];
+    while (img_if.read(reinterpret_cast<char*>(chunk_hdr), 8)) {
+      const char* type = reinterpret_cast<const char*>(&chunk_hdr[1]);
+      if (std::memcmp(type, "acTL", 4) == 0) {
+        estimate->is_apng = true;
+        break;
+      }
+      if (std::memcmp(type, "IDAT", 4) == 0 || std::memcmp(type, "IEND", 4) == 0) break;
+
+      // Skip data & CRC.
+      img_if.seekg(std::streamoff(ntohl(chunk_hdr[0])) + 4, img_if.cur);
+    }
+    img_if.clear();
+    img_if.seekg(0, img_if.end);
+    estimate->file_bytes = std::max<std::streamoff>(0, img_if.tellg());
+
+    estimate->valid            = true;
+    estimate->width            = chunk.width;
+    estimate->height           = chunk.height;
+    estimate->bit_depth        = static_cast<uint8_t>(chunk.bit_depth);
+    estimate->color_type       = static_cast<uint8_t>(chunk.color_type);
+    estimate->interlace_method = static_cast<uint8_t>(chunk.interlace_method);
+
+    const double pixels = static_cast<double>(chunk.width) * chunk.height;
+    const double source_pixel_bytes = channels_of(estimate->color_type) * estimate->bit_depth / 8.0;
+    estimate->predicted_seconds = pixels *
+      (SCHEDULE_NS_PER_PIXEL_BASE + SCHEDULE_NS_PER_SOURCE_PIXEL_BYTE * source_pixel_bytes) / 1e9;
+    return 0;
+  }
+
+  void order(Policy policy, const std::vector<Estimate>& estimates, std::vector<size_t>* order) {
+    order->resize(estimates.size());
+    std::iota(order->begin(), order->end(), 0);
+
+    if (policy == Policy::LargestFirst) {
+      std::stable_sort(order->begin(), order->end(), [&](size_t a, size_t b) {
+        return estimates[a].predicted_seconds > estimates[b].predicted_seconds;
+      });
+    } else if (policy == Policy::ShortestFirst) {
+      std::stable_sort(order->begin(), order->end(), [&](size_t a, size_t b) {
+        return estimates[a].predicted_seconds < estimates[b].predicted_seconds;
+      });
+    }
+  }
+};
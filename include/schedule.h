@@ -0,0 +1,78 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Size-aware batch scheduling. Each file's cost is estimated up front from its IHDR,
+// without decoding, and the batch ordered by it.
+namespace schedule {
+  enum class Policy {
+    // Manifest order.
+    Fifo,
+
+    // Largest first, minimizing the makespan.
+    LargestFirst,
+
+    // Shortest first, minimizing the mean latency.
+    ShortestFirst,
+  };
+
+  // Cost model: predicted time = pixels * (base + per source byte * source bytes per pixel).
+  // The output side is always 8bit RGBA, the input side scales with the source format.
+  #define SCHEDULE_NS_PER_PIXEL_BASE        40.0
+  #define SCHEDULE_NS_PER_SOURCE_PIXEL_BYTE 20.0
+
+  // Estimated cost of a single file.
+  struct Estimate {
+    // Whether the IHDR could be parsed. Unknown files are scheduled as zero cost.
+    bool     valid = false;
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint8_t  bit_depth = 0;
+    uint8_t  color_type = 0;
+    uint8_t  interlace_method = 0;
+
+    // Encoded file size, and whether an acTL chunk marks it as animated.
+    size_t   file_bytes = 0;
+    bool     is_apng = false;
+
+    double   predicted_seconds = 0;
+  };
+
+  /**
+   * Parses a policy name.
+   *
+   * @param name One of 'fifo', 'largest' or 'shortest'
+   * @param policy Policy pointer for which to populate.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int parse_policy(const std::string& name, Policy* policy);
+
+  /**
+   * Returns the policy's name.
+   */
+  const char* policy_name(Policy policy);
+
+  /**
+   * Estimates a file's processing cost from its IHDR, through png::_parse_img_chunk.
+   * Only chunk headers up to the image data are read past it.
+   *
+   * @param filepath Filepath to a PNG image
+   * @param estimate Estimate pointer for which to populate.
+   *
+   * @returns Status code, where non-zero means the IHDR couldn't be read.
+   */
+  int estimate_file(const std::string& filepath, Estimate* estimate);
+
+  /**
+   * Orders indices into the estimates by the given policy. Ties keep their original order.
+   *
+   * @param policy Scheduling policy
+   * @param estimates Per item estimates
+   * @param order Indices vector for which to populate.
+   */
+  void order(Policy policy, const std::vector<Estimate>& estimates, std::vector<size_t>* order);
+};
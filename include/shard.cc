@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "shard.h"
+
+
+namespace shard {
+  int parse_manifest(const std::string& filepath, std::vector<ManifestItem>* items) {
+    std::ifstream manifest_if;
+    manifest_if.open(filepath);
+
+    // Early return if failed to open.
+    if (!manifest_if.is_open()) {
+      fmt::println("Failed to open manifest '{}'", filepath);
+      return -1;
+    }
+
+    std::string line;
+    for (size_t line_num = 1; std::getline(manifest_if, line); line_num++) {
+      std::istringstream fields(line);
+      ManifestItem item;
+
+      // Skip blank lines & comments.
+      if (!(fields >> item.in_filepath) || item.in_filepath[0] == '#') continue;
+
+      if (!(fields >> item.out_filepath)) {
+        fmt::println("Invalid manifest line {}: Expected 'INPUT OUTPUT'", line_num);
+        return -1;
+      }
+      items->push_back(item);
+    }
+
+    return 0;
+  }
+
+  // Shared state of a sharded worker.
+  struct Worker {
+    std::string id;
+    std::string lease_dir;
+    size_t      lease_ttl_seconds;
+
+    // Lease currently held, heartbeat by a background thread.
+    std::mutex              mutex;
+    std::condition_variable stop_cv;
+    bool                    stopping = false;
+    std::string             held_lease;
+
+    // Contents of the last lease claimed, the holder id along with a nonce unique to the claim.
+    std::string             lease_token;
+    std::mt19937_64         nonce_rng{ std::random_device{}() };
+  };
+
+  static std::string chunk_lease_path(const Worker& w, size_t chunk) {
+    return fmt::format("{}/chunk-{}.lease", w.lease_dir, chunk);
+  }
+
+  static std::string chunk_done_path(const Worker& w, size_t chunk) {
+    return fmt::format("{}/chunk-{}.done", w.lease_dir, chunk);
+  }
+
+  static std::string item_done_path(const Worker& w, size_t item) {
+    return fmt::format("{}/item-{}.done", w.lease_dir, item);
+  }
+
+  static bool path_exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+  }
+
+  /**
+   * Exclusively creates a file with the given contents. O_EXCL is atomic on local
+   * filesystems as well as NFSv3+.
+   *
+   * @returns Status code, where 0 is created, 1 is already existing, and negative means failure.
+   */
+  static int create_exclusive(const std::string& path, const std::string& contents) {
+    int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0) return errno == EEXIST ? 1 : -1;
+
+    ssize_t written = write(fd, contents.data(), contents.size());
+    close(fd);
+    return written == ssize_t(contents.size()) ? 0 : -1;
+  }
+
+  static std::string read_contents(const std::string& path) {
+    std::ifstream in(path);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+  }
+
+  /**
+   * Current time as seen by the filesystem holding the leases. Comparing lease mtimes
+   * against it rather than the local clock keeps expiry correct across skewed nodes.
+   */
+  static time_t fs_now(const Worker& w) {
+    std::string clock_path = fmt::format("{}/.clock-{}", w.lease_dir, w.id);
+    int fd = open(clock_path.c_str(), O_CREAT | O_WRONLY, 0644);
+    if (fd >= 0) {
+      futimens(fd, NULL);
+      close(fd);
+    }
+
+    struct stat st;
+    if (stat(clock_path.c_str(), &st) != 0) return time(NULL);
+    return st.st_mtime;
+  }
+
+  static bool owns_lease(const Worker& w, const std::string& lease_path) {
+    return read_contents(lease_path) == w.lease_token;
+  }
+
+  /**
+   * Tries to claim a chunk, reclaiming the lease if its holder stopped heartbeating.
+   *
+   * @returns Status code, where 0 is claimed, 1 is held by a live worker, and negative means failure.
+   */
+  static int try_claim(Worker& w, size_t chunk, Stats* stats) {
+    std::string lease_path = chunk_lease_path(w, chunk);
+    w.lease_token = fmt::format("{} {:016x}\n", w.id, w.nonce_rng());
+
+    int status = create_exclusive(lease_path, w.lease_token);
+    if (status != 1) return status;
+
+    // Held by someone, check whether they're still alive. Contents are read first,
+    // so a lease replaced in between shows up with a fresh mtime.
+    std::string expired_token = read_contents(lease_path);
+    struct stat lease_st;
+    if (stat(lease_path.c_str(), &lease_st) != 0) return 1;
+    if (fs_now(w) - lease_st.st_mtime <= time_t(w.lease_ttl_seconds)) return 1;
+
+    // Expired. Only one reclaimer wins the rename, everyone else gets ENOENT.
+    std::string expired_path = fmt::format("{}.expired-{}", lease_path, w.id);
+    if (rename(lease_path.c_str(), expired_path.c_str()) != 0) return 1;
+
+    // Between the stat & rename the lease may have been reclaimed by another worker.
+    // Hand it back if what got renamed isn't the expired lease. Each claim's contents are
+    // unique, unlike inode numbers which the filesystem may reuse for the new lease.
+    if (read_contents(expired_path) != expired_token) {
+      if (link(expired_path.c_str(), lease_path.c_str()) != 0) {
+        fmt::println("Failed to hand back lease '{}': {}", lease_path, std::strerror(errno));
+      }
+      unlink(expired_path.c_str());
+      return 1;
+    }
+    unlink(expired_path.c_str());
+
+    status = create_exclusive(lease_path, w.lease_token);
+    if (status == 0) stats->reclaimed++;
+    return status;
+  }
+
+  // Keeps the held lease's mtime fresh until stopped.
+  static void heartbeat_loop(Worker* w) {
+    auto interval = std::chrono::milliseconds(std::max<size_t>(1, w->lease_ttl_seconds * 1000 / 3));
+
+    std::unique_lock<std::mutex> lock(w->mutex);
+    while (!w->stop_cv.wait_for(lock, interval, [w]() { return w->stopping; })) {
+      if (!w->held_lease.empty()) {
+        utimensat(AT_FDCWD, w->held_lease.c_str(), NULL, 0);
+      }
+    }
+  }
+
+  static void set_held_lease(Worker& w, const std::string& lease_path) {
+    std::lock_guard<std::mutex> lock(w.mutex);
+    w.held_lease = lease_path;
+  }
+
+  // Worker stats live in their own directory, so the report never lists the per item markers.
+  static std::string workers_dir(const Worker& w) {
+    return w.lease_dir + "/workers";
+  }
+
+  // Publishes this worker's counters for the aggregated report, atomically through a rename.
+  static void write_worker_stats(const Worker& w, const Stats& stats, time_t started_at) {
+    std::string stats_path = fmt::format("{}/worker-{}.stats", workers_dir(w), w.id);
+    std::string tmp_path   = stats_path + ".tmp";
+
+    std::ofstream out(tmp_path, std::ios::trunc);
+    out << fmt::format("{} {} {} {}\n", stats.processed, stats.failed, started_at, fs_now(w));
+    out.close();
+    rename(tmp_path.c_str(), stats_path.c_str());
+  }
+
+  // Prints progress aggregated across every worker sharing the lease directory. Each item is
+  // counted by the worker that created its marker, so the workers' counts sum to the items done.
+  static void print_progress(const Worker& w, size_t total_items) {
+    DIR* dir = opendir(workers_dir(w).c_str());
+    if (!dir) return;
+
+    size_t workers = 0;
+    size_t processed = 0;
+    size_t failed = 0;
+    time_t first_start = 0;
+    time_t last_update = 0;
+
+    while (dirent* entry = readdir(dir)) {
+      std::string name = entry->d_name;
+      if (!name.starts_with("worker-") || !name.ends_with(".stats")) continue;
+
+      std::ifstream in(workers_dir(w) + "/" + name);
+      size_t worker_processed, worker_failed;
+      time_t started_at, updated_at;
+      if (!(in >> worker_processed >> worker_failed >> started_at >> updated_at)) continue;
+
+      workers++;
+      processed += worker_processed;
+      failed    += worker_failed;
+      first_start = first_start == 0 ? started_at : std::min(first_start, started_at);
+      last_update = std::max(last_update, updated_at);
+    }
+    closedir(dir);
+
+    size_t done_items = processed + failed;
+    double elapsed = std::max<time_t>(1, last_update - first_start);
+    fmt::println(
+      "Progress: {}/{} items ({:.1f}%), {} failed, {} workers, {:.2f} items/s",
+      done_items, total_items, total_items ? 100.0 * done_items / total_items : 100.0,
+      failed, workers, processed / elapsed
+    );
+  }
+
+  /**
+   * Processes a claimed chunk as one batch.
+   *
+   * @returns Status code, where non-zero means the batch failed.
+   */
+  static int process_chunk(Worker& w, size_t chunk, size_t chunk_size, const std::vector<ManifestItem>& items, const BatchFn& process, Stats* stats) {
+    std::string lease_path = chunk_lease_path(w, chunk);
+    set_held_lease(w, lease_path);
+
+    size_t begin = chunk * chunk_size;
+    size_t end = std::min(items.size(), begin + chunk_size);
+
+    // Skip items already done by a previous holder of this chunk.
+    std::vector<size_t> pending;
+    for (size_t i = begin; i < end; i++) {
+      if (path_exists(item_done_path(w, i))) stats->skipped++;
+      else                                   pending.push_back(i);
+    }
+
+    // Stop before each item once the chunk was reclaimed while we were stalled, so two
+    // holders never write the same output.
+    std::atomic<bool> lost = false;
+    auto cancelled = [&]() {
+      if (!lost && !owns_lease(w, lease_path) && !lost.exchange(true)) {
+        fmt::println("Lost lease on chunk {}, leaving it to its new holder", chunk);
+      }
+      return lost.load();
+    };
+
+    int status = process(pending, [&](size_t i, int item_status) {
+      // Whoever creates the marker first owns the result.
+      int marked = create_exclusive(item_done_path(w, i), fmt::format("{} {}\n", w.id, item_status == 0 ? "ok" : "failed"));
+      if (marked == 1) {
+        stats->skipped++;
+      } else if (item_status != 0) {
+        stats->failed++;
+      } else {
+        stats->processed++;
+      }
+    }, cancelled);
+
+    // Leave the lease to expire, so the chunk gets retried.
+    if (status != 0) {
+      set_held_lease(w, "");
+      return status;
+    }
+
+    if (cancelled()) {
+      set_held_lease(w, "");
+      return 0;
+    }
+
+    create_exclusive(chunk_done_path(w, chunk), w.id + "\n");
+    set_held_lease(w, "");
+    unlink(lease_path.c_str());
+    stats->chunks++;
+    return 0;
+  }
+
+  // Processes everything in this process, without any coordination.
+  static int run_local(const std::vector<ManifestItem>& items, const BatchFn& process, Stats* stats) {
+    std::vector<size_t> all(items.size());
+    for (size_t i = 0; i < items.size(); i++) {
+      all[i] = i;
+    }
+
+    return process(all, [&](size_t, int status) {
+      if (status != 0) stats->failed++;
+      else             stats->processed++;
+    }, nullptr);
+  }
+
+  int run(const Options& opts, const std::vector<ManifestItem>& items, const BatchFn& process, Stats* stats) {
+    auto start = std::chrono::steady_clock::now();
+
+    if (!opts.shard_workers) {
+      int status = run_local(items, process, stats);
+      stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      return status;
+    }
+
+    if (opts.chunk_size == 0 || opts.lease_ttl_seconds == 0) {
+      fmt::println("Chunk size & lease TTL must be non-zero");
+      return -1;
+    }
+
+    Worker w;
+    w.lease_dir = opts.lease_dir.empty() ? opts.manifest_filepath + ".leases" : opts.lease_dir;
+    w.lease_ttl_seconds = opts.lease_ttl_seconds;
+
+    char hostname[256] = {};
+    gethostname(hostname, sizeof(hostname) - 1);
+    w.id = fmt::format("{}-{}", hostname, getpid());
+
+    for (const std::string& dir : { w.lease_dir, workers_dir(w) }) {
+      if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        fmt::println("Failed to create lease directory '{}': {}", dir, std::strerror(errno));
+        return -1;
+      }
+    }
+
+    time_t started_at = fs_now(w);
+    std::thread heartbeat(heartbeat_loop, &w);
+
+    size_t num_chunks = (items.size() + opts.chunk_size - 1) / opts.chunk_size;
+    auto poll_interval = std::chrono::milliseconds(std::min<size_t>(1000, opts.lease_ttl_seconds * 1000 / 4));
+    int status = 0;
+
+    // Keep sweeping until every chunk is done, picking up expired leases along the way.
+    while (true) {
+      bool all_done = true;
+      bool claimed_any = false;
+
+      for (size_t chunk = 0; chunk < num_chunks; chunk++) {
+        if (path_exists(chunk_done_path(w, chunk))) continue;
+        all_done = false;
+
+        int claimed = try_claim(w, chunk, stats);
+        if (claimed < 0) {
+          fmt::println("Failed to claim chunk {}: {}", chunk, std::strerror(errno));
+          status = -1;
+          break;
+        }
+        if (claimed == 1) continue;
+
+        claimed_any = true;
+        if (process_chunk(w, chunk, opts.chunk_size, items, process, stats) != 0) {
+          fmt::println("Failed to process chunk {}", chunk);
+          status = -1;
+          break;
+        }
+        write_worker_stats(w, *stats, started_at);
+        print_progress(w, items.size());
+      }
+
+      if (all_done || status != 0) break;
+      if (!claimed_any) std::this_thread::sleep_for(poll_interval);
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(w.mutex);
+      w.stopping = true;
+    }
+    w.stop_cv.notify_all();
+    heartbeat.join();
+
+    // Progress is printed after each processed chunk, otherwise report it once here.
+    write_worker_stats(w, *stats, started_at);
+    if (stats->chunks == 0) print_progress(w, items.size());
+    unlink(fmt::format("{}/.clock-{}", w.lease_dir, w.id).c_str());
+
+    stats->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return status;
+  }
+};
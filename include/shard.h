@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Manifest driven batch runs, optionally sharded across any number of processes/nodes
+// sharing a (NFS) directory. Work is claimed in chunks through lease files:
+//  - chunk-K.lease     Held by one worker, heartbeat through its mtime. Expired leases get reclaimed.
+//  - chunk-K.done      Chunk fully processed.
+//  - item-I.done       Item processed, created exclusively so each item is marked exactly once.
+//  - workers/worker-ID.stats
+//                      Per worker counters, aggregated into the progress report without listing the markers.
+namespace shard {
+  // One line of the manifest.
+  struct ManifestItem {
+    std::string in_filepath;
+    std::string out_filepath;
+  };
+
+  struct Options {
+    std::string manifest_filepath;
+
+    // Coordinate with other processes through lease files.
+    bool        shard_workers = false;
+
+    // Directory holding the leases & markers. Defaults to '<manifest>.leases'.
+    std::string lease_dir;
+
+    // Items claimed per lease.
+    size_t      chunk_size = 16;
+
+    // Seconds without a heartbeat before a lease is considered dead.
+    size_t      lease_ttl_seconds = 60;
+  };
+
+  // Results of this worker's run.
+  struct Stats {
+    size_t processed = 0;
+    size_t failed    = 0;
+    size_t skipped   = 0;
+    size_t chunks    = 0;
+    size_t reclaimed = 0;
+    double seconds   = 0;
+  };
+
+  // Reports an item's result, given its manifest index & status.
+  using DoneFn = std::function<void(size_t index, int status)>;
+
+  // Checked before each item is read & written. Once it returns true, the remaining items
+  // are left without a result.
+  using CancelFn = std::function<bool()>;
+
+  // Processes the items at the given manifest indices, calling done once per item unless cancelled.
+  // Returns a non-zero status if the batch itself failed, leaving items without a result.
+  using BatchFn = std::function<int(const std::vector<size_t>& indices, const DoneFn& done, const CancelFn& cancelled)>;
+
+  /**
+   * Parses a manifest file. Each line holds 'INPUT OUTPUT' separated by whitespace,
+   * blank lines and lines starting with '#' are skipped.
+   *
+   * @param filepath Path to the manifest
+   * @param items Items vector for which to populate.
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int parse_manifest(const std::string& filepath, std::vector<ManifestItem>* items);
+
+  /**
+   * Processes the manifest's items. With shard_workers set, claims chunks through
+   * lease files until every chunk is done, reclaiming leases of dead workers.
+   *
+   * @param opts Run options
+   * @param items Parsed manifest items
+   * @param process Function processing a batch of items
+   * @param stats Stats pointer for which to populate
+   *
+   * @returns Status code, where non-zero means failure.
+   */
+  int run(const Options& opts, const std::vector<ManifestItem>& items, const BatchFn& process, Stats* stats);
+};
@@ -1,23 +1,31 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <filesystem>
 #include <fmt/core.h>
 #include <fmt/format.h>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 
 #include <libpng16/png.h>
 #include <png.h>
 #include <unistd.h>
 #include "pngconf.h"
 
-template<typename T>
-struct Vector2D {
-  T x;
-  T y;
-};
+#include "apng.h"
+#include "budget.h"
+#include "corners.h"
+#include "io_engine.h"
+#include "optimize.h"
+#include "png_io.h"
+#include "quantize.h"
+#include "schedule.h"
+#include "shard.h"
 
 struct CommandLineArgs {
   // Filepath to a valid PNG image.
@@ -31,6 +39,31 @@ struct CommandLineArgs {
   // Radius value.
   size_t radius = 0;
   bool _radius_required = true;
+
+  // Size-optimizing encode, along with the number of trial workers. 0 uses all cores.
+  bool optimize = false;
+  size_t optimize_workers = 0;
+
+  // Indexed output, reduced to a palette of quantize_opts.colors entries.
+  bool quantize = false;
+  quantize::Options quantize_opts;
+
+  // Manifest batch run & sharding options.
+  shard::Options shard;
+  bool _is_batch = false;
+
+  // Batch I/O engine options.
+  io::Options io;
+
+  // Batch job ordering, by IHDR estimated cost. Explicitly picking one reports per file timings.
+  schedule::Policy schedule = schedule::Policy::Fifo;
+  bool _is_scheduled = false;
+
+  // Ceiling for the estimated memory of the images in flight, 0 means unlimited.
+  size_t max_memory_bytes = 0;
+
+  // Threads per APNG/optimize/quantize pool. Batch runs split the cores between their jobs, 0 uses all cores.
+  size_t _inner_workers = 0;
 };
 
 void print_help() {
@@ -46,6 +79,79 @@ void print_help() {
 
   fmt::println("  -o PATH");
   fmt::println("    filepath to image result. '-' Is supported to output to stdout. Defaults to 'out.png'");
+
+  fmt::println("  --optimize N");
+  fmt::println("    trial filter & zlib combinations across N worker threads, keeping the smallest output. 0 uses all cores");
+
+  fmt::println("  --quantize N");
+  fmt::println("    reduces the output to an indexed PNG with an N color palette (2-256), keeping alpha through tRNS");
+
+  fmt::println("  --dither");
+  fmt::println("    applies Floyd-Steinberg dithering when quantizing");
+
+  fmt::println("  --manifest FILE");
+  fmt::println("    processes every 'INPUT OUTPUT' line of FILE instead of a single FILEPATH");
+
+  fmt::println("  --shard-workers");
+  fmt::println("    claims manifest chunks through lease files, so any number of processes/nodes can share the work");
+
+  fmt::println("  --lease-dir DIR");
+  fmt::println("    directory holding the lease files. Defaults to '<manifest>.leases'");
+
+  fmt::println("  --chunk-size N");
+  fmt::println("    manifest items claimed per lease. Defaults to 16");
+
+  fmt::println("  --lease-ttl SECONDS");
+  fmt::println("    seconds without a heartbeat before a lease gets reclaimed. Defaults to 60");
+
+  fmt::println("  --io-engine uring|blocking");
+  fmt::println("    file I/O engine for batch runs. Falls back to blocking when io_uring is unavailable. Defaults to 'uring'");
+
+  fmt::println("  --jobs N");
+  fmt::println("    decode/encode worker threads for batch runs. 0 uses all cores. Defaults to 0");
+  fmt::println("    Cores are split between the jobs, capping the APNG, --optimize & --quantize threads of each");
+
+  fmt::println("  --queue-depth N");
+  fmt::println("    maximum number of files with I/O in flight for batch runs. Defaults to 64");
+
+  fmt::println("  --schedule fifo|largest|shortest");
+  fmt::println("    orders batch work by IHDR estimated cost. 'largest' minimizes the makespan, 'shortest' the mean latency.");
+  fmt::println("    Reports predicted versus actual time per file. Defaults to 'fifo'");
+
+  fmt::println("  --max-memory SIZE");
+  fmt::println("    only decodes images while their estimated footprint fits within SIZE bytes (K, M & G suffixes supported).");
+  fmt::println("    Images too large on their own are streamed row by row, or rejected when they can't be, before being read.");
+  fmt::println("    io_uring's registered buffers come out of the budget, clamping --queue-depth to a quarter of it");
+}
+
+/**
+* Parses the integer value following a flag.
+*
+* @param argc Number of arguments
+* @param argv Arguments
+* @param i Index of the flag, shifted past the value on success
+* @param value Value pointer for which to populate
+*
+* @returns Status code, where non-zero means failure.
+*/
+int parse_size_arg(int argc, char** argv, int& i, size_t* value) {
+  // Make sure there's a follow up argument for the value.
+  if ( i + 1 == argc ) {
+    fmt::println("Invalid {} argument. Expected integer value after flag", argv[i]);
+    print_help();
+    return 1;
+  }
+
+  try {
+    *value = std::stoull(argv[i + 1]);
+  } catch( std::invalid_argument& ) {
+    fmt::println("Invalid {} value! Expected integer value but got '{}'", argv[i], argv[i + 1]);
+    return -1;
+  }
+
+  // Shift argv.
+  ++i;
+  return 0;
 }
 
 int parse_args(int argc, char** argv, CommandLineArgs *cli_args) {
@@ -99,6 +205,141 @@ int parse_args(int argc, char** argv, CommandLineArgs *cli_args) {
       ++i;
     }
 
+    else if ( std::strcmp(argv[i], "--optimize") == 0 ) {
+      // Make sure there's a follow up argument for the value.
+      if ( i + 1 == argc ) {
+        fmt::println("Invalid optimize argument. Expected worker count after flag");
+        print_help();
+        return 1;
+      }
+
+      // Parse worker count.
+      try {
+        cli_args->optimize_workers = std::stoull(argv[i + 1]);
+      } catch( std::invalid_argument& ) {
+        fmt::println("Invalid optimize value! Expected integer value but got '{}'", argv[i + 1]);
+        return -1;
+      }
+      cli_args->optimize = true;
+
+      // Shift argv.
+      ++i;
+    }
+
+    else if ( std::strcmp(argv[i], "--quantize") == 0 ) {
+      if (int status = parse_size_arg(argc, argv, i, &cli_args->quantize_opts.colors); status != 0) return status;
+
+      if (cli_args->quantize_opts.colors < 2 || cli_args->quantize_opts.colors > QUANTIZE_MAX_COLORS) {
+        fmt::println("Invalid quantize value! Expected between 2 and {} colors but got '{}'", QUANTIZE_MAX_COLORS, cli_args->quantize_opts.colors);
+        return -1;
+      }
+      cli_args->quantize = true;
+    }
+
+    else if ( std::strcmp(argv[i], "--dither") == 0 ) {
+      cli_args->quantize_opts.dither = true;
+    }
+
+    else if ( std::strcmp(argv[i], "--manifest") == 0 ) {
+      // Make sure there's a follow up argument for the value.
+      if ( i + 1 == argc ) {
+        fmt::println("Invalid manifest argument. Expected string value after flag");
+        print_help();
+        return 1;
+      }
+      cli_args->shard.manifest_filepath = std::string{argv[i + 1]};
+      cli_args->_is_batch = true;
+      cli_args->_img_filepath_required = false;
+
+      // Shift argv.
+      ++i;
+    }
+
+    else if ( std::strcmp(argv[i], "--shard-workers") == 0 ) {
+      cli_args->shard.shard_workers = true;
+    }
+
+    else if ( std::strcmp(argv[i], "--lease-dir") == 0 ) {
+      // Make sure there's a follow up argument for the value.
+      if ( i + 1 == argc ) {
+        fmt::println("Invalid lease directory argument. Expected string value after flag");
+        print_help();
+        return 1;
+      }
+      cli_args->shard.lease_dir = std::string{argv[i + 1]};
+
+      // Shift argv.
+      ++i;
+    }
+
+    else if ( std::strcmp(argv[i], "--chunk-size") == 0 ) {
+      if (int status = parse_size_arg(argc, argv, i, &cli_args->shard.chunk_size); status != 0) return status;
+    }
+
+    else if ( std::strcmp(argv[i], "--lease-ttl") == 0 ) {
+      if (int status = parse_size_arg(argc, argv, i, &cli_args->shard.lease_ttl_seconds); status != 0) return status;
+    }
+
+    else if ( std::strcmp(argv[i], "--io-engine") == 0 ) {
+      // Make sure there's a follow up argument for the value.
+      if ( i + 1 == argc ) {
+        fmt::println("Invalid I/O engine argument. Expected engine name after flag");
+        print_help();
+        return 1;
+      }
+
+      if (io::parse_engine(argv[i + 1], &cli_args->io.engine) != 0) {
+        fmt::println("Invalid I/O engine! Expected 'uring' or 'blocking' but got '{}'", argv[i + 1]);
+        return -1;
+      }
+
+      // Shift argv.
+      ++i;
+    }
+
+    else if ( std::strcmp(argv[i], "--jobs") == 0 ) {
+      if (int status = parse_size_arg(argc, argv, i, &cli_args->io.workers); status != 0) return status;
+    }
+
+    else if ( std::strcmp(argv[i], "--queue-depth") == 0 ) {
+      if (int status = parse_size_arg(argc, argv, i, &cli_args->io.queue_depth); status != 0) return status;
+    }
+
+    else if ( std::strcmp(argv[i], "--schedule") == 0 ) {
+      // Make sure there's a follow up argument for the value.
+      if ( i + 1 == argc ) {
+        fmt::println("Invalid schedule argument. Expected policy name after flag");
+        print_help();
+        return 1;
+      }
+
+      if (schedule::parse_policy(argv[i + 1], &cli_args->schedule) != 0) {
+        fmt::println("Invalid schedule! Expected 'fifo', 'largest' or 'shortest' but got '{}'", argv[i + 1]);
+        return -1;
+      }
+      cli_args->_is_scheduled = true;
+
+      // Shift argv.
+      ++i;
+    }
+
+    else if ( std::strcmp(argv[i], "--max-memory") == 0 ) {
+      // Make sure there's a follow up argument for the value.
+      if ( i + 1 == argc ) {
+        fmt::println("Invalid max memory argument. Expected size after flag");
+        print_help();
+        return 1;
+      }
+
+      if (budget::parse_bytes(argv[i + 1], &cli_args->max_memory_bytes) != 0) {
+        fmt::println("Invalid max memory value! Expected size such as '512M' or '16G' but got '{}'", argv[i + 1]);
+        return -1;
+      }
+
+      // Shift argv.
+      ++i;
+    }
+
     // Positional argument for filepath.
     else {
       cli_args->img_filepath = std::string{argv[i]};
@@ -106,7 +347,19 @@ int parse_args(int argc, char** argv, CommandLineArgs *cli_args) {
   }
 
   // Ensure required args are passed in.
-  if (cli_args->_img_filepath_required && cli_args->img_filepath == "") {
+  if (cli_args->shard.shard_workers && !cli_args->_is_batch) {
+    fmt::println("--shard-workers requires a --manifest!");
+    print_help();
+    return 1;
+  } else if (cli_args->quantize && cli_args->optimize) {
+    fmt::println("--quantize and --optimize can't be combined!");
+    print_help();
+    return 1;
+  } else if (cli_args->quantize_opts.dither && !cli_args->quantize) {
+    fmt::println("--dither requires --quantize!");
+    print_help();
+    return 1;
+  } else if (cli_args->_img_filepath_required && cli_args->img_filepath == "") {
     fmt::println("No required image filepath was given!");
     print_help();
     return 1;
@@ -135,65 +388,125 @@ void print_png_info(const CommandLineArgs& cli_args, png_structp& png_ptr, png_i
   fmt::println(output, "  - Width      = {}", width);
 }
 
+/**
+* Reads the PNG's rows expanded into 8bit RGBA, once libpng's IO has been set up.
+*
+* @param png_ptr Pointer to the PNG image struct
+* @param info_ptr Pointer to the PNG image info struct
+* @param row_pointers PNG pixels for which to allocate & populate
+*/
+void read_png_rows(png_structp& png_ptr, png_infop& info_ptr, png_bytepp& row_pointers) {
+  png_io::read_rgba_info(png_ptr, info_ptr);
+  png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+
+  // TODO: make more C++ like.
+  row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
+  for(png_uint_32 y = 0; y < height; y++) {
+    row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png_ptr, info_ptr));
+  }
+  png_read_image(png_ptr, row_pointers);
+
+}
+
+/**
+* Frees the PNG read structs & rows, including rows left behind by a read libpng aborted.
+*
+* @param png_ptr Pointer to the PNG image struct
+* @param info_ptr Pointer to the PNG image info struct
+* @param row_pointers PNG pixels, or NULL when none were allocated
+*/
+void free_png_read(png_structp& png_ptr, png_infop& info_ptr, png_bytepp& row_pointers) {
+  if (row_pointers) {
+    png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+    for (png_uint_32 y = 0; y < height; y++) {
+      free(row_pointers[y]);
+    }
+    free(row_pointers);
+    row_pointers = NULL;
+  }
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+}
+
 int read_png_file(const char* filepath, png_structp& png_ptr, png_infop& info_ptr, png_bytepp& row_pointers) {
+  // Opening doubles as the existence check, saving a stat.
   FILE* fp = fopen(filepath, "rb");
   if (!fp) {
-    fmt::println("Failed to open image '{}'", filepath);
+    fmt::println("Failed to open image '{}': {}", filepath, std::strerror(errno));
     return -1;
   }
 
   // Read PNG image.
+  row_pointers = NULL;
   png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
   info_ptr = png_create_info_struct(png_ptr);
-  if(!info_ptr) return 1;
+  if(!info_ptr) {
+    free_png_read(png_ptr, info_ptr, row_pointers);
+    fclose(fp);
+    return 1;
+  }
 
-  if(setjmp(png_jmpbuf(png_ptr))) return 1;
+  if(setjmp(png_jmpbuf(png_ptr))) {
+    free_png_read(png_ptr, info_ptr, row_pointers);
+    fclose(fp);
+    return 1;
+  }
 
   png_init_io(png_ptr, fp);
-  png_read_info(png_ptr, info_ptr);
-
-  // Configure color types.
-  png_byte color_type = png_get_color_type(png_ptr, info_ptr);
-  png_byte bit_depth  = png_get_bit_depth(png_ptr, info_ptr);
-  png_uint_32 height  = png_get_image_height(png_ptr, info_ptr);
-
-  // Read any color_type into 8bit depth, RGBA format.
-  // See http://www.libpng.org/pub/png/libpng-manual.txt
+  read_png_rows(png_ptr, info_ptr, row_pointers);
 
-  if(bit_depth == 16)
-    png_set_strip_16(png_ptr);
-
-  if(color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_palette_to_rgb(png_ptr);
+  fclose(fp);
+  return 0;
+}
 
-  // PNG_COLOR_TYPE_GRAY_ALPHA is always 8 or 16bit depth.
-  if(color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-    png_set_expand_gray_1_2_4_to_8(png_ptr);
+int read_png_buffer(const std::vector<png_byte>& buffer, png_structp& png_ptr, png_infop& info_ptr, png_bytepp& row_pointers) {
+  png_io::BufferReader reader = { &buffer, 0 };
 
-  if(png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
-    png_set_tRNS_to_alpha(png_ptr);
+  // Read PNG image.
+  row_pointers = NULL;
+  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  info_ptr = png_create_info_struct(png_ptr);
+  if(!info_ptr) {
+    free_png_read(png_ptr, info_ptr, row_pointers);
+    return 1;
+  }
 
-  // These color_type don't have an alpha channel then fill it with 0xff.
-  if(color_type == PNG_COLOR_TYPE_RGB ||
-     color_type == PNG_COLOR_TYPE_GRAY ||
-     color_type == PNG_COLOR_TYPE_PALETTE)
-    png_set_filler(png_ptr, 0xFF, PNG_FILLER_AFTER);
+  // Batch workers read many images, so a corrupt one mustn't leak its structs & rows.
+  if(setjmp(png_jmpbuf(png_ptr))) {
+    free_png_read(png_ptr, info_ptr, row_pointers);
+    return 1;
+  }
 
-  if(color_type == PNG_COLOR_TYPE_GRAY ||
-     color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-    png_set_gray_to_rgb(png_ptr);
+  png_set_read_fn(png_ptr, &reader, png_io::buffer_read_fn);
+  read_png_rows(png_ptr, info_ptr, row_pointers);
+  return 0;
+}
 
-  png_read_update_info(png_ptr, info_ptr);
+/**
+* Writes the rows as an 8bit RGBA PNG, once libpng's IO has been set up.
+*
+* @param png_ptr Pointer to the PNG write struct
+* @param info_ptr Pointer to the PNG image info struct
+* @param row_pointers PNG pixels
+*/
+void write_png_rows(png_structp png_ptr, png_infop& info_ptr, png_bytepp& row_pointers) {
+  png_uint_32 height  = png_get_image_height(png_ptr, info_ptr);
+  png_uint_32 width  = png_get_image_width(png_ptr, info_ptr);
 
-  // TODO: make more C++ like.
-  row_pointers = (png_bytep*)malloc(sizeof(png_bytep) * height);
-  for(png_uint_32 y = 0; y < height; y++) {
-    row_pointers[y] = (png_byte*)malloc(png_get_rowbytes(png_ptr, info_ptr));
-  }
-  png_read_image(png_ptr, row_pointers);
+  // Output is 8bit depth, RGBA format.
+  png_set_IHDR(
+    png_ptr,
+    info_ptr,
+    width, height,
+    8,
+    PNG_COLOR_TYPE_RGBA,
+    PNG_INTERLACE_NONE,
+    PNG_COMPRESSION_TYPE_DEFAULT,
+    PNG_FILTER_TYPE_DEFAULT
+  );
 
-  fclose(fp);
-  return 0;
+  // Write that PNG!
+  png_set_rows(png_ptr, info_ptr, row_pointers);
+  png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
 }
 
 int write_png_file(const char* filepath, png_infop& info_ptr, png_bytepp& row_pointers) {
@@ -214,13 +527,60 @@ int write_png_file(const char* filepath, png_infop& info_ptr, png_bytepp& row_po
   if (use_stdout) png_init_io(png_ptr, stdout);
   else            png_init_io(png_ptr, fp);
 
-  png_uint_32 height  = png_get_image_height(png_ptr, info_ptr);
-  png_uint_32 width  = png_get_image_width(png_ptr, info_ptr);
+  write_png_rows(png_ptr, info_ptr, row_pointers);
+
+  // Clean up!
+  png_destroy_write_struct(&png_ptr, NULL);
+  if (!use_stdout) fclose(fp);
+  return 0;
+}
+
+int write_png_buffer(std::vector<png_byte>* out, png_infop& info_ptr, png_bytepp& row_pointers) {
+  out->clear();
+
+  // Create IO to write PNG into memory.
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, NULL);
+    return 1;
+  }
+
+  png_set_write_fn(png_ptr, out, png_io::buffer_write_fn, png_io::buffer_flush_fn);
+  write_png_rows(png_ptr, info_ptr, row_pointers);
+
+  // Clean up!
+  png_destroy_write_struct(&png_ptr, NULL);
+  return 0;
+}
+
+/**
+* Streams the image row by row into an 8bit RGBA PNG, masking each row's corners on the way,
+* once libpng's IO has been set up on both sides. Only a single row is held in memory.
+*
+* @param radius_px Radius to apply on the image
+* @param read_ptr Pointer to the PNG read struct
+* @param read_info Pointer to the read side's info struct
+* @param write_ptr Pointer to the PNG write struct
+* @param write_info Pointer to the write side's info struct
+*
+* @returns Status code, where non-zero means failure.
+*/
+int stream_png_rows(size_t radius_px, png_structp& read_ptr, png_infop& read_info, png_structp& write_ptr, png_infop& write_info) {
+  png_io::read_rgba_info(read_ptr, read_info);
+
+  png_uint_32 width  = png_get_image_width(read_ptr, read_info);
+  png_uint_32 height = png_get_image_height(read_ptr, read_info);
+
+  // Interlaced passes only complete rows at the very end.
+  if (png_get_interlace_type(read_ptr, read_info) != PNG_INTERLACE_NONE) {
+    fmt::println("Interlaced images can't be streamed row by row");
+    return 1;
+  }
 
   // Output is 8bit depth, RGBA format.
   png_set_IHDR(
-    png_ptr,
-    info_ptr,
+    write_ptr,
+    write_info,
     width, height,
     8,
     PNG_COLOR_TYPE_RGBA,
@@ -228,31 +588,153 @@ int write_png_file(const char* filepath, png_infop& info_ptr, png_bytepp& row_po
     PNG_COMPRESSION_TYPE_DEFAULT,
     PNG_FILTER_TYPE_DEFAULT
   );
+  png_write_info(write_ptr, write_info);
 
-  // Write that PNG!
-  png_set_rows(png_ptr, info_ptr, row_pointers);
-  png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+  std::vector<png_byte> row(png_get_rowbytes(read_ptr, read_info));
+  png_bytep row_pointer = row.data();
+  for (png_uint_32 y = 0; y < height; y++) {
+    png_read_row(read_ptr, row_pointer, NULL);
+    corners::apply_clipped({ 0, ssize_t(y), ssize_t(width), 1 }, width, height, radius_px, &row_pointer);
+    png_write_row(write_ptr, row_pointer);
+  }
 
-  // Clean up!
-  png_destroy_write_struct(&png_ptr, NULL);
-  if (!use_stdout) fclose(fp);
+  png_write_end(write_ptr, NULL);
+  png_read_end(read_ptr, NULL);
   return 0;
 }
 
 /**
-* Checks whether the given point is inside the circle.
+* Streams a PNG image held in memory, see stream_png_rows.
+*
+* @param radius_px Radius to apply on the image
+* @param in Contents of a PNG image
+* @param out Buffer for which to populate with the resulting image
+*
+* @returns Status code, where non-zero means failure.
+*/
+int stream_png_buffer(size_t radius_px, const std::vector<png_byte>& in, std::vector<png_byte>* out) {
+  png_io::BufferReader reader = { &in, 0 };
+  out->clear();
+
+  png_structp read_ptr   = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop   read_info  = png_create_info_struct(read_ptr);
+  png_structp write_ptr  = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop   write_info = png_create_info_struct(write_ptr);
+
+  int status = 1;
+  if (setjmp(png_jmpbuf(read_ptr)) == 0) {
+    if (setjmp(png_jmpbuf(write_ptr)) == 0) {
+      png_set_read_fn(read_ptr, &reader, png_io::buffer_read_fn);
+      png_set_write_fn(write_ptr, out, png_io::buffer_write_fn, png_io::buffer_flush_fn);
+      status = stream_png_rows(radius_px, read_ptr, read_info, write_ptr, write_info);
+    }
+  }
+
+  // Clean up!
+  png_destroy_write_struct(&write_ptr, &write_info);
+  png_destroy_read_struct(&read_ptr, &read_info, NULL);
+  return status;
+}
+
+/**
+* Streams a PNG file, see stream_png_rows.
+*
+* @param radius_px Radius to apply on the image
+* @param in_filepath Filepath to a PNG image
+* @param out_filepath Resulting image path. '-' writes to stdout
+*
+* @returns Status code, where non-zero means failure.
+*/
+int stream_png_file(size_t radius_px, const char* in_filepath, const char* out_filepath) {
+  FILE* in_fp = fopen(in_filepath, "rb");
+  if (!in_fp) {
+    fmt::println("Failed to open image '{}': {}", in_filepath, std::strerror(errno));
+    return 1;
+  }
+
+  // Check if we're outputing to stdout.
+  bool use_stdout = std::string{out_filepath} == "-";
+  FILE* out_fp = use_stdout ? stdout : fopen(out_filepath, "wb");
+  if (!out_fp) {
+    fmt::println("Failed write image to '{}': Failed to open file: {}", out_filepath, std::strerror(errno));
+    fclose(in_fp);
+    return 1;
+  }
+
+  png_structp read_ptr   = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop   read_info  = png_create_info_struct(read_ptr);
+  png_structp write_ptr  = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop   write_info = png_create_info_struct(write_ptr);
+
+  int status = 1;
+  if (setjmp(png_jmpbuf(read_ptr)) == 0) {
+    if (setjmp(png_jmpbuf(write_ptr)) == 0) {
+      png_init_io(read_ptr, in_fp);
+      png_init_io(write_ptr, out_fp);
+      status = stream_png_rows(radius_px, read_ptr, read_info, write_ptr, write_info);
+    }
+  }
+
+  // Clean up!
+  png_destroy_write_struct(&write_ptr, &write_info);
+  png_destroy_read_struct(&read_ptr, &read_info, NULL);
+  fclose(in_fp);
+  if (!use_stdout) fclose(out_fp);
+  return status;
+}
+
+/**
+* Writes the smallest PNG found by trialing filter & zlib combinations.
 *
-* @param point The current point being checked
-* @param circle_midpoint Point in the center of the circle
-* @param radius Circle's radius
+* @param filepath Resulting image path. '-' writes to stdout
+* @param png_ptr Pointer to the PNG image struct
+* @param info_ptr Pointer to the PNG image info struct
+* @param row_pointers Pointer to the PNG image pixels
+* @param workers Number of trial worker threads, 0 uses all cores
+* @param stats Stats pointer for which to populate
 *
-* @returns Boolean indicating whether the point is in the circle
+* @returns Status code, where non-zero means failure.
 */
-bool is_inside_circle(Vector2D<ssize_t> point, Vector2D<ssize_t> circle_midpoint, ssize_t radius) {
-  ssize_t a = std::labs( point.x - circle_midpoint.x );
-  ssize_t b = std::labs( point.y - circle_midpoint.y );
-  ssize_t c = std::sqrt( (a*a) + (b*b) );
-  return c < radius;
+int write_optimized_png_file(const char* filepath, png_structp& png_ptr, png_infop& info_ptr, png_bytepp& row_pointers, size_t workers, optimize::Stats* stats) {
+  png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+  png_uint_32 width  = png_get_image_width(png_ptr, info_ptr);
+
+  std::vector<png_byte> encoded;
+  if (optimize::encode_smallest(width, height, row_pointers, workers, &encoded, stats) != 0) {
+    fmt::println("Failed write image to '{}': Failed to encode image", filepath);
+    return 1;
+  }
+
+  return png_io::write_file(filepath, encoded);
+}
+
+/**
+* Writes the rows quantized down to an indexed PNG.
+*
+* @param filepath Resulting image path. '-' writes to stdout
+* @param png_ptr Pointer to the PNG image struct
+* @param info_ptr Pointer to the PNG image info struct
+* @param row_pointers Pointer to the PNG image pixels
+* @param opts Quantization options
+* @param stats Stats pointer for which to populate
+* @param size_bytes Size pointer for which to populate with the written image's size
+*
+* @returns Status code, where non-zero means failure.
+*/
+int write_quantized_png_file(const char* filepath, png_structp& png_ptr, png_infop& info_ptr, png_bytepp& row_pointers,
+                             const quantize::Options& opts, quantize::Stats* stats, size_t* size_bytes) {
+  png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+  png_uint_32 width  = png_get_image_width(png_ptr, info_ptr);
+
+  quantize::IndexedImage indexed;
+  std::vector<png_byte> encoded;
+  if (quantize::quantize(width, height, row_pointers, opts, &indexed, stats) != 0 || quantize::encode_indexed(indexed, &encoded) != 0) {
+    fmt::println("Failed write image to '{}': Failed to quantize image", filepath);
+    return 1;
+  }
+
+  *size_bytes = encoded.size();
+  return png_io::write_file(filepath, encoded);
 }
 
 /**
@@ -315,7 +797,7 @@ int apply_radius(int radius_px, png_structp& png_ptr, png_infop& info_ptr, png_b
       png_bytep row = row_pointers[y];
       for (int x = 0; x < radius_px; x++) {
         // Only update the pixel within the circle radius.
-        if (!is_inside_circle({ x, y }, midpoint, radius_px)) {
+        if (!corners::is_inside_circle({ x, y }, midpoint, radius_px)) {
           png_bytep px = &(row[x * channels]);
 
           // Make transparent!
@@ -337,7 +819,7 @@ int apply_radius(int radius_px, png_structp& png_ptr, png_infop& info_ptr, png_b
       png_bytep row = row_pointers[y];
       for (int x = x0; x < width; x++) {
         // Only update the pixel within the circle radius.
-        if (!is_inside_circle({ x, y }, midpoint, radius_px)) {
+        if (!corners::is_inside_circle({ x, y }, midpoint, radius_px)) {
           png_bytep px = &(row[x * channels]);
 
           // Make transparent!
@@ -360,7 +842,7 @@ int apply_radius(int radius_px, png_structp& png_ptr, png_infop& info_ptr, png_b
       png_bytep row = row_pointers[y];
       for (int x = x0; x < width; x++) {
         // Only update the pixel within the circle radius.
-        if (!is_inside_circle({ x, y }, midpoint, radius_px)) {
+        if (!corners::is_inside_circle({ x, y }, midpoint, radius_px)) {
           png_bytep px = &(row[x * channels]);
 
           // Make transparent!
@@ -382,7 +864,7 @@ int apply_radius(int radius_px, png_structp& png_ptr, png_infop& info_ptr, png_b
       png_bytep row = row_pointers[y];
       for (int x = 0; x < radius_px; x++) {
         // Only update the pixel within the circle radius.
-        if (!is_inside_circle({ x, y }, midpoint, radius_px)) {
+        if (!corners::is_inside_circle({ x, y }, midpoint, radius_px)) {
           png_bytep px = &(row[x * channels]);
 
           // Make transparent!
@@ -399,17 +881,139 @@ int apply_radius(int radius_px, png_structp& png_ptr, png_infop& info_ptr, png_b
 }
 
 
-// TODO: add some more checks.
-int main(int argc, char** argv) {
-  CommandLineArgs cli_args;
-  if (parse_args(argc, argv, &cli_args) != 0) {
-    return 1;
+/**
+* Threads per APNG/optimize/quantize pool, all cores unless a batch run split them between its jobs.
+*/
+size_t resolve_inner_workers(const CommandLineArgs& cli_args) {
+  return cli_args._inner_workers != 0 ? cli_args._inner_workers : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+* Threads trialing --optimize encodes, capped to a batch job's share of the cores.
+*/
+size_t resolve_optimize_workers(const CommandLineArgs& cli_args) {
+  size_t workers = cli_args.optimize_workers != 0 ? cli_args.optimize_workers : resolve_inner_workers(cli_args);
+  return cli_args._inner_workers != 0 ? std::min(workers, cli_args._inner_workers) : workers;
+}
+
+/**
+* Decides how an image fits the memory budget, given its IHDR estimate. Images whose footprint
+* alone exceeds the budget get streamed row by row, or rejected when they can't be.
+* The footprint covers:
+*  - The decoded 8bit RGBA rows, once per frame worker for animated images.
+*  - With --optimize, a trial encode per worker, each cut off once larger than the best so far.
+*  - With --quantize, the palette indices at a byte per pixel.
+*  - For batch runs, the encoded input & the output.
+* Trials & outputs are assumed no larger than the decoded rows, since palette & gray inputs expand to RGBA.
+* Streamed images skip --quantize & --optimize, with a warning.
+*
+* @param cli_args Parsed command line arguments
+* @param estimate The image's IHDR estimate
+* @param limit_bytes Budget available to images
+* @param in_memory Whether the encoded input & output are held in memory
+* @param in_filepath Filepath to the image, for reporting
+* @param reserve_bytes Footprint for which to populate, to reserve against the budget
+* @param stream Flag for which to populate, set when the image must be streamed
+*
+* @returns Status code, where non-zero means the image was rejected.
+*/
+int admit_image(const CommandLineArgs& cli_args, const schedule::Estimate& estimate, size_t limit_bytes, bool in_memory,
+                const std::string& in_filepath, size_t* reserve_bytes, bool* stream) {
+  size_t rgba_bytes = budget::decoded_bytes(estimate.width, estimate.height);
+  size_t encoded_bytes = in_memory ? estimate.file_bytes + rgba_bytes : 0;
+  size_t decoded_bytes = rgba_bytes;
+  if (estimate.is_apng) {
+    decoded_bytes *= resolve_inner_workers(cli_args);
+  } else if (cli_args.optimize) {
+    decoded_bytes += resolve_optimize_workers(cli_args) * rgba_bytes;
+  } else if (cli_args.quantize) {
+    decoded_bytes += size_t(estimate.width) * estimate.height;
+  }
+  decoded_bytes += encoded_bytes;
+
+  *reserve_bytes = decoded_bytes;
+  *stream = false;
+  if (limit_bytes == 0 || decoded_bytes <= limit_bytes) return 0;
+
+  // Animated & interlaced images need every row decoded at once.
+  if (!estimate.is_apng && estimate.interlace_method == PNG_INTERLACE_NONE) {
+    // The streamed output compresses like the input, once expanded to 8bit RGBA.
+    size_t channels = estimate.color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4 : estimate.color_type == PNG_COLOR_TYPE_RGB ? 3 :
+                      estimate.color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+    size_t input_bits = std::max<size_t>(1, channels * estimate.bit_depth);
+    size_t output_bytes = std::min(rgba_bytes, estimate.file_bytes * 32 / input_bits);
+
+    *reserve_bytes = budget::streamed_bytes(estimate.width) + (in_memory ? estimate.file_bytes + output_bytes : 0);
+    *stream = true;
+    if (*reserve_bytes <= limit_bytes) {
+      // Streaming only applies the radius, writing 8bit RGBA.
+      if (cli_args.quantize || cli_args.optimize) {
+        fmt::println("Streaming image '{}' without {}: needs ~{}B, over the {}B available under the memory budget",
+                     in_filepath, cli_args.quantize ? "--quantize" : "--optimize", decoded_bytes, limit_bytes);
+      }
+      return 0;
+    }
   }
 
-  // Verify valid filepath.
-  if (!std::filesystem::exists(cli_args.img_filepath)) {
-    fmt::println("Please provide a valid filepath to a PNG image. '{}' does not exist!", cli_args.img_filepath);
-    return 1;
+  fmt::println("Rejected image '{}': needs ~{}B, over the {}B available under the memory budget", in_filepath, decoded_bytes, limit_bytes);
+  return 1;
+}
+
+/**
+* Applies the radius to a single image and writes the result.
+*
+* @param cli_args Parsed command line arguments
+* @param in_filepath Filepath to a PNG image
+* @param out_filepath Resulting image path. '-' writes to stdout
+*
+* @returns Status code, where non-zero means failure.
+*/
+int process_image(const CommandLineArgs& cli_args, const std::string& in_filepath, const std::string& out_filepath) {
+  FILE* output = out_filepath == "-" ? stderr : stdout;
+  bool is_apng = apng::is_apng_file(in_filepath);
+
+  // Images too large for the memory budget get streamed row by row instead.
+  schedule::Estimate estimate;
+  if (cli_args.max_memory_bytes != 0 && schedule::estimate_file(in_filepath, &estimate) == 0) {
+    size_t reserve_bytes;
+    bool stream;
+    if (admit_image(cli_args, estimate, cli_args.max_memory_bytes, false, in_filepath, &reserve_bytes, &stream) != 0) {
+      return 1;
+    }
+
+    if (stream) {
+      if (stream_png_file(cli_args.radius, in_filepath.c_str(), out_filepath.c_str()) != 0) {
+        fmt::println("Failed to stream image");
+        return 1;
+      }
+
+      fmt::println(output, "Streamed Image:");
+      fmt::println(output, "  - Height     = {}", estimate.height);
+      fmt::println(output, "  - Width      = {}", estimate.width);
+      fmt::println(output, "  - Budget     = {}B", cli_args.max_memory_bytes);
+      fmt::println(output, "  - Peak RSS   = {}B", budget::peak_rss_bytes());
+      fmt::println(output, "Wrote new image to '{}'", out_filepath);
+      return 0;
+    }
+  }
+
+  // Animated images are handled frame by frame, since libpng only sees the default image.
+  if (is_apng) {
+    apng::Stats stats;
+    if (apng::process_file(in_filepath, out_filepath, cli_args.radius, &stats) != 0) {
+      fmt::println("Failed to process animated PNG image");
+      return 1;
+    }
+
+    if (!cli_args._is_batch) {
+      fmt::println(output, "Animated Image Parsed:");
+      fmt::println(output, "  - Frames          = {}", stats.frames);
+      fmt::println(output, "  - Modified frames = {}", stats.modified_frames);
+      fmt::println(output, "  - Masked pixels   = {}", stats.masked_pixels);
+      fmt::println(output, "  - Workers         = {}", stats.workers);
+      fmt::println(output, "Wrote new image to '{}'", out_filepath);
+    }
+    return 0;
   }
 
   // Shared PNG structs between read/write contexts.
@@ -418,35 +1022,391 @@ int main(int argc, char** argv) {
   png_bytepp row_pointers;
 
   // Read image.
-  if (read_png_file(cli_args.img_filepath.c_str(), png_ptr, info_ptr, row_pointers) != 0) {
+  if (read_png_file(in_filepath.c_str(), png_ptr, info_ptr, row_pointers) != 0) {
     fmt::println("Failed to read PNG image");
     return 1;
   }
 
   // Alright now we're cookin.
-  png_uint_32 height  = png_get_image_height(png_ptr, info_ptr);
-  print_png_info(cli_args, png_ptr, info_ptr);
+  if (!cli_args._is_batch) print_png_info(cli_args, png_ptr, info_ptr);
 
   // Do stuff with image.
+  int status = 1;
   if (apply_radius(cli_args.radius, png_ptr, info_ptr, row_pointers) == 0) {
-    if (write_png_file(cli_args.out_filepath.c_str(), info_ptr, row_pointers) != 0) {
+    if (cli_args.optimize) {
+      optimize::Stats stats;
+      if (write_optimized_png_file(out_filepath.c_str(), png_ptr, info_ptr, row_pointers, cli_args.optimize_workers, &stats) != 0) {
+        fmt::println("Failed to write image");
+      }
+      else {
+        status = 0;
+
+        if (!cli_args._is_batch) {
+          fmt::println(output, "Optimized Output:");
+          fmt::println(output, "  - Default size = {}B", stats.default_size_bytes);
+          fmt::println(output, "  - Best size    = {}B", stats.best_size_bytes);
+          fmt::println(output, "  - Saved        = {}B ({:.2f}%)",
+            stats.default_size_bytes - stats.best_size_bytes,
+            100.0 * (stats.default_size_bytes - stats.best_size_bytes) / stats.default_size_bytes
+          );
+          fmt::println(output, "  - Best filters = 0x{:02x}, level = {}, strategy = {}", stats.best.filters, stats.best.level, stats.best.strategy);
+          fmt::println(output, "  - Candidates   = {} ({} abandoned)", stats.candidates, stats.abandoned);
+          fmt::println(output, "  - Workers      = {}", stats.workers);
+          fmt::println(output, "  - CPU time     = {:.3f}s (wall {:.3f}s)", stats.cpu_seconds, stats.wall_seconds);
+          fmt::println(output, "Wrote new image to '{}'", out_filepath);
+        }
+      }
+    }
+    else if (cli_args.quantize) {
+      quantize::Stats stats;
+      size_t size_bytes;
+      if (write_quantized_png_file(out_filepath.c_str(), png_ptr, info_ptr, row_pointers, cli_args.quantize_opts, &stats, &size_bytes) != 0) {
+        fmt::println("Failed to write image");
+      }
+      else {
+        status = 0;
+
+        if (!cli_args._is_batch) {
+          // Savings are against the RGBA encode the indexed output replaces, which only the report pays for.
+          std::vector<png_byte> truecolor;
+          write_png_buffer(&truecolor, info_ptr, row_pointers);
+
+          fmt::println(output, "Quantized Output:");
+          fmt::println(output, "  - Colors         = {} ({})", stats.colors, stats.lossless ? "kept losslessly" : "median cut");
+          fmt::println(output, "  - Palette        = {} entries{}", stats.palette_colors, cli_args.quantize_opts.dither && !stats.lossless ? ", dithered" : "");
+          fmt::println(output, "  - Truecolor size = {}B", truecolor.size());
+          fmt::println(output, "  - Indexed size   = {}B", size_bytes);
+          fmt::println(output, "  - Saved          = {}B ({:.2f}%)",
+            ssize_t(truecolor.size()) - ssize_t(size_bytes),
+            100.0 * (ssize_t(truecolor.size()) - ssize_t(size_bytes)) / std::max<size_t>(1, truecolor.size())
+          );
+          fmt::println(output, "  - Workers        = {}", stats.workers);
+          fmt::println(output, "  - Quantize time  = {:.3f}s", stats.seconds);
+          fmt::println(output, "Wrote new image to '{}'", out_filepath);
+        }
+      }
+    }
+    else if (write_png_file(out_filepath.c_str(), info_ptr, row_pointers) != 0) {
       fmt::println("Failed to write image");
     }
     else {
-      fmt::println(
-        cli_args._is_out_to_stdout ? stderr : stdout,
-        "Wrote new image to '{}'",
-        cli_args.out_filepath.c_str()
-      );
+      if (!cli_args._is_batch) fmt::println(output, "Wrote new image to '{}'", out_filepath);
+      status = 0;
     }
   }
 
   // When all is done, clean up shared info ptr.
-  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-  for (png_uint_32 y = 0; y < height; y++) {
-    free(row_pointers[y]);
+  free_png_read(png_ptr, info_ptr, row_pointers);
+  return status;
+}
+
+// Optimize & quantize stats summed across a batch run's jobs.
+struct EncodeTotals {
+  std::mutex mutex;
+
+  size_t optimized            = 0;
+  size_t default_size_bytes   = 0;
+  size_t best_size_bytes      = 0;
+  double optimize_cpu_seconds = 0;
+
+  size_t quantized        = 0;
+  size_t lossless         = 0;
+  size_t indexed_bytes    = 0;
+  double quantize_seconds = 0;
+};
+
+/**
+* Applies the radius to a single image held in memory, for batch runs.
+*
+* @param cli_args Parsed command line arguments
+* @param in_filepath Filepath the image was read from, for reporting
+* @param in Contents of a PNG image
+* @param out Buffer for which to populate with the resulting image
+* @param totals Totals to which the image's optimize or quantize stats get added
+*
+* @returns Status code, where non-zero means failure.
+*/
+int process_image_buffer(const CommandLineArgs& cli_args, const std::string& in_filepath, const std::vector<png_byte>& in, std::vector<png_byte>* out,
+                         EncodeTotals* totals) {
+  // Animated images are handled frame by frame, since libpng only sees the default image.
+  if (apng::is_apng_buffer(in)) {
+    apng::Stats stats;
+    if (apng::process_buffer(in, out, cli_args.radius, cli_args._inner_workers, &stats) != 0) {
+      fmt::println("Failed to process animated PNG image '{}'", in_filepath);
+      return 1;
+    }
+    return 0;
   }
-  free(row_pointers);
-  return 0;
+
+  // Shared PNG structs between read/write contexts.
+  png_structp png_ptr;
+  png_infop info_ptr;
+  png_bytepp row_pointers;
+
+  if (read_png_buffer(in, png_ptr, info_ptr, row_pointers) != 0) {
+    fmt::println("Failed to read PNG image '{}'", in_filepath);
+    return 1;
+  }
+  png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+  png_uint_32 width  = png_get_image_width(png_ptr, info_ptr);
+
+  int status = 1;
+  if (apply_radius(cli_args.radius, png_ptr, info_ptr, row_pointers) == 0) {
+    if (cli_args.optimize) {
+      optimize::Stats stats;
+      status = optimize::encode_smallest(width, height, row_pointers, resolve_optimize_workers(cli_args), out, &stats);
+      if (status == 0) {
+        std::lock_guard<std::mutex> lock(totals->mutex);
+        totals->optimized++;
+        totals->default_size_bytes   += stats.default_size_bytes;
+        totals->best_size_bytes      += stats.best_size_bytes;
+        totals->optimize_cpu_seconds += stats.cpu_seconds;
+      }
+    } else if (cli_args.quantize) {
+      quantize::IndexedImage indexed;
+      quantize::Stats stats;
+      quantize::Options opts = cli_args.quantize_opts;
+      opts.workers = cli_args._inner_workers;
+      status = quantize::quantize(width, height, row_pointers, opts, &indexed, &stats);
+      if (status == 0) status = quantize::encode_indexed(indexed, out);
+      if (status == 0) {
+        std::lock_guard<std::mutex> lock(totals->mutex);
+        totals->quantized++;
+        totals->lossless         += stats.lossless;
+        totals->indexed_bytes    += out->size();
+        totals->quantize_seconds += stats.seconds;
+      }
+    } else {
+      status = write_png_buffer(out, info_ptr, row_pointers);
+    }
+
+    if (status != 0) fmt::println("Failed to encode image '{}'", in_filepath);
+  }
+
+  // When all is done, clean up shared info ptr.
+  free_png_read(png_ptr, info_ptr, row_pointers);
+  return status;
 }
 
+
+// TODO: add some more checks.
+int main(int argc, char** argv) {
+  CommandLineArgs cli_args;
+  if (parse_args(argc, argv, &cli_args) != 0) {
+    return 1;
+  }
+
+  // Batch run over a manifest, optionally sharded across processes.
+  if (cli_args._is_batch) {
+    std::vector<shard::ManifestItem> items;
+    if (shard::parse_manifest(cli_args.shard.manifest_filepath, &items) != 0) {
+      return 1;
+    }
+
+    // Every job runs its own APNG/optimize/quantize pools, so split the cores between them
+    // rather than starting jobs * cores threads.
+    size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    size_t jobs = cli_args.io.workers == 0 ? cores : cli_args.io.workers;
+    cli_args._inner_workers = std::max<size_t>(1, cores / jobs);
+
+    // Per file timings, used to tune the schedule's cost model.
+    struct Timing {
+      size_t index;
+      double predicted_seconds;
+      double actual_seconds;
+      double latency_seconds;
+    };
+    std::vector<Timing> timings;
+
+    // Memory admission, shared by every batch.
+    budget::Budget memory;
+    memory.limit_bytes = cli_args.max_memory_bytes;
+    std::atomic<size_t> memory_streamed = 0;
+    std::atomic<size_t> memory_rejected = 0;
+    EncodeTotals totals;
+
+    // The uring engine's registered slots stay allocated for the whole run, so they come out of the
+    // budget up front, with the queue depth clamped for them to take at most a quarter of it.
+    size_t io_buffer_bytes = 0;
+    if (cli_args.max_memory_bytes != 0 && cli_args.io.engine == io::EngineType::Uring) {
+      size_t max_slots = cli_args.max_memory_bytes / 4 / IO_URING_SLOT_BYTES;
+      if (max_slots == 0) {
+        fmt::println("Memory budget too small for io_uring's registered buffers, using blocking I/O");
+        cli_args.io.engine = io::EngineType::Blocking;
+      } else {
+        cli_args.io.queue_depth = std::min(std::max<size_t>(1, cli_args.io.queue_depth), max_slots);
+        io_buffer_bytes = cli_args.io.queue_depth * IO_URING_SLOT_BYTES;
+        budget::try_acquire(&memory, io_buffer_bytes);
+      }
+    }
+
+    // Every batch of manifest items runs through the same I/O engine, in scheduled order.
+    io::Engine* engine;
+    if (io::open_engine(cli_args.io, &engine) != 0) {
+      fmt::println("Failed to set up the I/O engine");
+      return 1;
+    }
+
+    auto process = [&](const std::vector<size_t>& indices, const shard::DoneFn& done, const shard::CancelFn& cancelled) {
+      // Estimating opens every input ahead of the engine, so only pay for it when ordering or admission needs it.
+      std::vector<schedule::Estimate> estimates(indices.size());
+      if (cli_args._is_scheduled || cli_args.max_memory_bytes != 0) {
+        for (size_t i = 0; i < indices.size(); i++) {
+          schedule::estimate_file(items[indices[i]].in_filepath, &estimates[i]);
+        }
+      }
+
+      std::vector<size_t> order;
+      schedule::order(cli_args.schedule, estimates, &order);
+
+      std::vector<io::Job> jobs;
+      for (size_t i : order) {
+        jobs.push_back({ items[indices[i]].in_filepath, items[indices[i]].out_filepath, estimates[i].file_bytes });
+      }
+
+      // Each job's slots are only written before its read, or by the worker processing it, and read once it's done.
+      std::vector<double> actual_seconds(jobs.size(), 0);
+      std::vector<size_t> reserved_bytes(jobs.size(), 0);
+      std::vector<char>   streamed(jobs.size(), false);
+      auto batch_start = std::chrono::steady_clock::now();
+
+      io::Hooks hooks;
+      hooks.cancelled = cancelled;
+
+      // Each image's estimated footprint is reserved before its input is read, so held & rejected
+      // images never take memory.
+      size_t waiting_job = jobs.size();
+      if (cli_args.max_memory_bytes != 0) {
+        hooks.admit = [&](size_t job_index) {
+          size_t reserve_bytes;
+          bool stream;
+          const schedule::Estimate& estimate = estimates[order[job_index]];
+          if (admit_image(cli_args, estimate, memory.limit_bytes - io_buffer_bytes, true, jobs[job_index].in_filepath, &reserve_bytes, &stream) != 0) {
+            memory_rejected++;
+            return io::Admission::Reject;
+          }
+
+          if (!budget::try_acquire(&memory, reserve_bytes)) {
+            if (waiting_job != job_index) memory.waits++;
+            waiting_job = job_index;
+            return io::Admission::Wait;
+          }
+          reserved_bytes[job_index] = reserve_bytes;
+          streamed[job_index] = stream;
+          return io::Admission::Admit;
+        };
+        hooks.release = [&](size_t job_index) {
+          budget::release(&memory, reserved_bytes[job_index]);
+        };
+      }
+
+      auto process_job = [&](size_t job_index, const io::Job& job, const std::vector<png_byte>& in, std::vector<png_byte>* out) {
+        int status;
+        auto start = std::chrono::steady_clock::now();
+        if (streamed[job_index]) {
+          memory_streamed++;
+          if ((status = stream_png_buffer(cli_args.radius, in, out)) != 0) {
+            fmt::println("Failed to stream image '{}'", job.in_filepath);
+          }
+        } else {
+          status = process_image_buffer(cli_args, job.in_filepath, in, out, &totals);
+        }
+        actual_seconds[job_index] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return status;
+      };
+      auto job_done = [&](size_t job_index, int status) {
+        size_t i = order[job_index];
+        if (status == 0) {
+          timings.push_back({
+            indices[i],
+            estimates[i].predicted_seconds,
+            actual_seconds[job_index],
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - batch_start).count(),
+          });
+        }
+        done(indices[i], status);
+      };
+
+      return io::run_batch(engine, jobs, process_job, job_done, hooks);
+    };
+
+    shard::Stats stats;
+    int status = shard::run(cli_args.shard, items, process, &stats);
+
+    io::Stats io_stats;
+    io::close_engine(engine, &io_stats);
+    if (status != 0) {
+      fmt::println("Failed to process manifest '{}'", cli_args.shard.manifest_filepath);
+      return 1;
+    }
+
+    fmt::println("Manifest Processed:");
+    fmt::println("  - Items     = {}", items.size());
+    fmt::println("  - Processed = {}", stats.processed);
+    fmt::println("  - Failed    = {}", stats.failed);
+    fmt::println("  - Skipped   = {}", stats.skipped);
+    if (cli_args.shard.shard_workers) {
+      fmt::println("  - Chunks    = {} ({} reclaimed)", stats.chunks, stats.reclaimed);
+    }
+    fmt::println("  - Time      = {:.3f}s ({:.2f} items/s)", stats.seconds, stats.processed / std::max(stats.seconds, 1e-9));
+
+    size_t files = std::max<size_t>(1, stats.processed + stats.failed);
+    fmt::println("I/O Engine:");
+    fmt::println("  - Engine      = {}", io::engine_name(io_stats.engine));
+    fmt::println("  - Workers     = {}", io_stats.workers);
+    fmt::println("  - Syscalls    = {} ({:.1f} per file)", io_stats.syscalls, double(io_stats.syscalls) / files);
+    fmt::println("  - I/O ops     = {}", io_stats.ops);
+    fmt::println("  - Queue depth = {:.1f} avg, {} max", io_stats.avg_queue_depth, io_stats.max_queue_depth);
+    fmt::println("  - Read        = {}B, written = {}B", io_stats.bytes_read, io_stats.bytes_written);
+
+    if (cli_args.optimize) {
+      fmt::println("Optimized Output:");
+      fmt::println("  - Images       = {}", totals.optimized);
+      fmt::println("  - Default size = {}B", totals.default_size_bytes);
+      fmt::println("  - Best size    = {}B", totals.best_size_bytes);
+      fmt::println("  - Saved        = {}B ({:.2f}%)",
+        totals.default_size_bytes - totals.best_size_bytes,
+        100.0 * (totals.default_size_bytes - totals.best_size_bytes) / std::max<size_t>(1, totals.default_size_bytes)
+      );
+      fmt::println("  - CPU time     = {:.3f}s", totals.optimize_cpu_seconds);
+    }
+
+    // Batch runs skip the truecolor encode the single image report compares against.
+    if (cli_args.quantize) {
+      fmt::println("Quantized Output:");
+      fmt::println("  - Images         = {} ({} kept losslessly)", totals.quantized, totals.lossless);
+      fmt::println("  - Indexed size   = {}B", totals.indexed_bytes);
+      fmt::println("  - Quantize time  = {:.3f}s", totals.quantize_seconds);
+    }
+
+    if (cli_args._is_scheduled) {
+      double predicted_sum = 0, actual_sum = 0, latency_sum = 0;
+      for (const Timing& timing : timings) {
+        predicted_sum += timing.predicted_seconds;
+        actual_sum    += timing.actual_seconds;
+        latency_sum   += timing.latency_seconds;
+      }
+      fmt::println("Schedule:");
+      fmt::println("  - Policy       = {}", schedule::policy_name(cli_args.schedule));
+      fmt::println("  - Predicted    = {:.3f}s, actual = {:.3f}s ({:.2f}x)", predicted_sum, actual_sum, actual_sum / std::max(predicted_sum, 1e-9));
+      fmt::println("  - Mean latency = {:.3f}s", latency_sum / std::max<size_t>(1, timings.size()));
+      for (const Timing& timing : timings) {
+        fmt::println("    {:>10.3f}ms predicted, {:>10.3f}ms actual  {}",
+          timing.predicted_seconds * 1e3, timing.actual_seconds * 1e3, items[timing.index].in_filepath);
+      }
+    }
+
+    if (cli_args.max_memory_bytes != 0) {
+      fmt::println("Memory:");
+      fmt::println("  - Budget        = {}B", memory.limit_bytes);
+      fmt::println("  - I/O buffers   = {}B", io_buffer_bytes);
+      fmt::println("  - Peak reserved = {}B ({:.1f}% of budget)", memory.peak_bytes, 100.0 * memory.peak_bytes / memory.limit_bytes);
+      fmt::println("  - Peak RSS      = {}B", budget::peak_rss_bytes());
+      fmt::println("  - Waits         = {}", memory.waits);
+      fmt::println("  - Streamed      = {}, rejected = {}", memory_streamed.load(), memory_rejected.load());
+    }
+    return stats.failed == 0 ? 0 : 1;
+  }
+
+  return process_image(cli_args, cli_args.img_filepath, cli_args.out_filepath);
+}
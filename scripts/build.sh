@@ -12,7 +12,7 @@ bear -- g++ \
   -g \
   -lpthread \
   -lfmt \
-  $(pkg-config --cflags --libs libpng) \
+  $(pkg-config --cflags --libs libpng zlib) \
   -Wall \
   -Wextra \
   -Wno-unused-parameter \
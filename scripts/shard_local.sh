@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+set -e
+
+# Runs several sharded workers on one box against a temporary lease directory,
+# exercising the same lease protocol used across nodes. An expired lease left by a
+# dead worker is planted on the first chunk, which must get reclaimed.
+#   ./scripts/shard_local.sh MANIFEST WORKERS [app args]
+MANIFEST="$1"
+WORKERS="$2"
+shift 2
+
+LEASE_DIR="$(mktemp -d)"
+trap 'rm -rf "$LEASE_DIR"' EXIT
+
+# Plant a lease whose holder stopped heartbeating an hour ago.
+echo "dead-worker 0000000000000000" > "$LEASE_DIR/chunk-0.lease"
+touch -d '1 hour ago' "$LEASE_DIR/chunk-0.lease"
+
+for i in $(seq "$WORKERS"); do
+  ./app --manifest "$MANIFEST" --shard-workers --lease-dir "$LEASE_DIR" "$@" > "$LEASE_DIR/worker-$i.log" &
+done
+wait
+cat "$LEASE_DIR"/worker-*.log
+
+# Every item must have been marked exactly once, none of them by the dead worker.
+TOTAL="$(grep -cv -e '^\s*$' -e '^\s*#' "$MANIFEST")"
+DONE="$(find "$LEASE_DIR" -name 'item-*.done' | wc -l)"
+echo "Marked $DONE/$TOTAL items done"
+[ "$DONE" -eq "$TOTAL" ]
+if grep -l 'dead-worker' "$LEASE_DIR"/item-*.done; then
+  echo "Items marked by the dead worker"
+  exit 1
+fi
+
+# The planted lease must have been reclaimed, and the chunk completed.
+RECLAIMED="$(sed -n 's/.*Chunks .*(\([0-9]*\) reclaimed)/\1/p' "$LEASE_DIR"/worker-*.log | awk '{ sum += $1 } END { print sum + 0 }')"
+echo "Reclaimed $RECLAIMED expired lease(s)"
+[ "$RECLAIMED" -ge 1 ]
+[ -f "$LEASE_DIR/chunk-0.done" ]